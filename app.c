@@ -12,7 +12,7 @@ int main(int argc, char **argv)
     char c;
     char buffer[2048];
     char buffer2[8] = {50, 50, 50, 50, 50, 50, 50, 50};
-    int size;
+    long size;
     char vdiskname[200];
 
     printf("started\n");
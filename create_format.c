@@ -9,19 +9,31 @@ int main(int argc, char **argv)
     int ret;
     char vdiskname[200];
     int m;
+    int blocksize = BLOCKSIZE;
+    int flags = 0;
 
-    if (argc != 3)
+    // -s leaves the data blocks as holes in the vdisk file,
+    // -j reserves a metadata journal
+    while (argc > 1 && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-j") == 0))
     {
-        printf("usage: create_format <vdiskname> <m>\n");
+        flags |= strcmp(argv[1], "-s") == 0 ? VSFS_FORMAT_SPARSE : VSFS_FORMAT_JOURNAL;
+        argc--;
+        argv++;
+    }
+    if (argc != 3 && argc != 4)
+    {
+        printf("usage: create_format [-s] [-j] <vdiskname> <m> [blocksize]\n");
         exit(1);
     }
 
     strcpy(vdiskname, argv[1]);
     m = atoi(argv[2]);
+    if (argc == 4)
+        blocksize = atoi(argv[3]);
 
     printf("started\n");
 
-    ret = vsformat(vdiskname, m);
+    ret = vsformat_ex(vdiskname, m, blocksize, flags);
     if (ret != 0)
     {
         printf("there was an error in creating the disk\n");
@@ -6,14 +6,23 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
 #include "vsfs.h"
 
+// v1 disks have a fixed layout with room for 4096 data blocks
 #define MAX_BLOCK_COUNT 4096
 #define FREEBLOCK_BITVECTOR_SIZE MAX_BLOCK_COUNT / (16)
+// vsformat takes disks of 2^18 up to 2^36 bytes
+#define MIN_DISK_ORDER 18
+#define MAX_DISK_ORDER 36
 #define NO_START_BLOCK 0
 #define FAT_LIST_NULL 0
 
@@ -46,12 +55,24 @@
 #define vsfs_assert(...) (void)0
 #endif
 
+// counters and latency histograms of vsfs_get_stats, compiled in unless
+// built with -DNO_STATS
+#ifndef NO_STATS
+#define STATS
+#endif
+
+#ifdef STATS
+#define vsfs_count(fs, counter, n) \
+    __atomic_fetch_add(&(fs)->stats.counter, (n), __ATOMIC_RELAXED)
+#define vsfs_clock(start) uint64_t start = stats_clock()
+#define vsfs_latency(fs, call, start) stats_latency((fs), (call), (start))
+#else
+#define vsfs_count(fs, counter, n) (void)(n)
+#define vsfs_clock(...) (void)0
+#define vsfs_latency(...) (void)0
+#endif
+
 // type declarations ======================================
-typedef struct data_block
-{
-    // a byte array
-    uint8_t data[BLOCKSIZE];
-} data_block;
 /**
  * fat table entry is 4 bytes / 32 bits
  * since a block allocated for fat table can have (2048 / 4) = 512 entries
@@ -60,15 +81,21 @@ typedef struct data_block
  * the lower byte can be used to index FAT table block 0 to 511
  * This means that the FAT entry for block 4095 will be in FAT block 15
  * at offset 511
+ * (v1 disks only, a v2 FAT is dense: FAT_ENTRIES_PER_BLOCK per block)
  */
-#define FAT_OFFSET(blocknumber) blocknumber & 0x000000ff
-#define FAT_BLOCK(blocknumber) (blocknumber & 0xffffff00) >> 8
+#define FAT_OFFSET(blocknumber) ((blocknumber) & 0x000000ff)
+#define FAT_BLOCK(blocknumber) (((blocknumber) & 0xffffff00) >> 8)
+#define FAT_ENTRIES_PER_BLOCK(fs) ((fs)->blocksize / 4)
+#define BITMAP_BITS_PER_BLOCK(fs) ((fs)->blocksize * 8)
 
+// v1 disks only, their blocks are BLOCKSIZE bytes
 typedef struct fat_table_block
 {
     uint32_t entries[512];
 } fat_table_block;
 
+// v1 superblock: the layout is fixed, FAT in blocks 1-32, root
+// directory in blocks 33-40 and the free bit vector in here
 typedef struct super_block
 {
     int blockcount;
@@ -79,758 +106,4699 @@ typedef struct super_block
      * blocks
      */
     uint16_t freeblock_bitvector[FREEBLOCK_BITVECTOR_SIZE];
-    uint8_t padding[1528];
+    uint16_t reserved;
+    /**
+     * directory blocks beyond the 8 root blocks are taken from the data
+     * area and chained in the FAT. zero on disks that never outgrew the
+     * root directory.
+     */
+    uint32_t dirextstart;
+    uint32_t dirextcount;
+    uint8_t padding[1520];
 } super_block;
 
+#define VSFS_MAGIC 0x53465356 // "VSFS"
+#define VSFS_VERSION 2
+
+/**
+ * v2 superblock, at the start of block 0. the geometry is chosen at
+ * format time: block 0, then the free block bitmap (a bit set per used
+ * block), the FAT (one entry per block), the root directory and the
+ * data blocks. a v1 superblock has its block count and block size where
+ * v1blockcount and v1blocksize are, both zero here.
+ */
+typedef struct super_block_v2
+{
+    int32_t v1blockcount;
+    uint16_t v1blocksize;
+    uint16_t reserved;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blocksize;
+    uint32_t blockcount;
+    uint32_t bitmapstart;
+    uint32_t bitmapblocks;
+    uint32_t fatstart;
+    uint32_t fatblocks;
+    uint32_t rootdirstart;
+    uint32_t rootdirblocks;
+    uint32_t firstdatablock;
+    uint32_t dirextstart;
+    uint32_t dirextcount;
+    uint32_t journalstart; // 0 on disks formatted without a journal
+    uint32_t journalblocks;
+    uint8_t padding[444]; // must be 512 bytes
+} super_block_v2;
+
+#define INLINE_BYTES 76 // files up to this size live in their directory entry
+#define DIRENT_INLINE 0x1 // the data is in inlinedata, the file has no blocks
+#define DIRENT_PACKED 0x2 // the last partial block is in a pack block
+#define DIRENT_SHARED 0x4 // cloned, the chain may share blocks with other files
+#define DIRENT_FORKED 0x8 // the chain leaves the FAT after forkblock
+
 typedef struct directory_entry
 {
     bool isoccupied;
     char filename[30];
     uintmax_t filesize;
     uint32_t startblock;
-    uint8_t freebytes[80]; // must be 128 bytes
+    uint8_t flags; // DIRENT_*, v2 disks only. v1 never initialised these
+                   // bytes, they are cleared when a v1 directory is loaded
+    uint8_t reserved;
+    uint16_t tailoffset; // DIRENT_PACKED: where the tail starts in packblock
+    union
+    {
+        uint8_t inlinedata[INLINE_BYTES]; // must be 128 bytes
+        struct
+        {
+            uint32_t packblock; // DIRENT_PACKED
+            // DIRENT_FORKED: the block after forkblock is forknext instead
+            // of its FAT entry, FAT_LIST_NULL when the file ends there
+            uint32_t forkblock;
+            uint32_t forknext;
+        };
+    };
 } directory_entry;
 
 typedef struct openfiletable_entry
 {
     directory_entry *entry;
+    int32_t slot; // directory slot of entry
     int mode;
     bool free;
+    // read cursor: byte offset into the file and the block holding it
+    uintmax_t offset;
+    uint32_t currblock;
+    // last block read through this descriptor, so that reads smaller
+    // than a block do not go back to the disk
+    uint8_t *readbuf;
+    uint32_t readbufblock;
+    // physical block of every logical block of the file, built on the
+    // first vsseek/vspread so that any offset is found without walking
+    // the FAT chain
+    uint32_t *blockindex;
+    uint32_t blockindexcount;
+    // readahead: offset the next sequential read starts at, window in
+    // blocks (0 when reads are not sequential) and the logical block
+    // the blocks in front of which were already read ahead
+    uintmax_t readaheadnext;
+    uint32_t readaheadwindow;
+    uintmax_t readaheadend;
+    // append state: last block of the chain and its in-memory contents.
+    // small appends collect in tailbuf, which is written once it fills
+    // up, on vsclose or on vsumount
+    uint32_t tailblock;
+    uint8_t *tailbuf;
+    bool taildirty;
+    pthread_mutex_t lock;
 } openfiletable_entry;
 
-typedef struct root_dir_block
-{
-    directory_entry entries[16];
-} root_dir_block;
+// a directory block is an array of directory entries
+#define DIRENTRIES_PER_BLOCK(fs) ((fs)->blocksize / sizeof(directory_entry))
+// root directory size of a new disk, in entries
+#define ROOTDIR_ENTRIES 128
 
 // ========================================================
 
-// globals  =======================================
-static int vs_fd; // file descriptor of the Linux file that acts as virtual disk.
-                  // this is not visible to an application.
-static super_block superblock;
-static fat_table_block fattable[32];
-static root_dir_block rootdir[8];
-static openfiletable_entry openfiletable[128];
-// ========================================================
+// per mount state  =======================================
+// geometry of the mounted disk, from either superblock version
+typedef struct vsfs_geometry
+{
+    uint32_t version;
+    uint32_t blockcount;
+    uint32_t bitmapstart; // v2 only, v1 keeps the bit vector in block 0
+    uint32_t bitmapblocks;
+    uint32_t fatstart;
+    uint32_t fatblocks;
+    uint32_t rootdirstart;
+    uint32_t rootdirblocks;
+    uint32_t firstdatablock;
+    uint32_t dirextstart;
+    uint32_t dirextcount;
+    uint32_t journalstart; // v2 only, between the root directory and the data
+    uint32_t journalblocks;
+} vsfs_geometry;
 
-// read block k from disk (virtual disk) into buffer block.
-// size of the block is BLOCKSIZE.
-// space for block must be allocated outside of this function.
-// block numbers start from 0 in the virtual disk.
-int read_block(void *block, int k)
+// the whole directory: the root blocks followed by the blocks taken
+// from the data area as it grows. slot i is entry i % DIRENTRIES_PER_BLOCK
+// of block i / DIRENTRIES_PER_BLOCK.
+typedef struct directory_table
+{
+    directory_entry **blocks;
+    uint32_t *blocknumbers;
+    bool *dirty; // for the blocks in the data area, root blocks use metadata_dirty
+    uint32_t count;
+    uint32_t capacity;
+} directory_table;
+
+// block cache, see below
+typedef struct cache_buffer
+{
+    uint32_t blocknumber;
+    bool valid;
+    bool dirty;
+    struct cache_buffer *prev; // lru list, head is most recently used
+    struct cache_buffer *next;
+    struct cache_buffer *hashnext;
+    uint8_t *data; // blocksize bytes
+} cache_buffer;
+
+typedef struct block_cache
+{
+    cache_buffer *buffers;
+    uint8_t *data; // the blocks of all buffers
+    int size;
+    cache_buffer **hash;
+    uint32_t hashmask;
+    cache_buffer lru; // list sentinel
+    struct vsfs_cachestats stats;
+    pthread_mutex_t lock;
+} block_cache;
+
+// free block allocator, see below
+typedef struct block_allocator
+{
+    uint64_t *freemap;
+    uint32_t words;     // words covering the blocks of this disk
+    uint32_t hint;      // word where the last allocation happened
+    uint32_t freecount; // number of set bits in freemap
+    pthread_mutex_t lock;
+} block_allocator;
+
+// directory index, see below
+typedef struct directory_index
+{
+    int32_t *table; // directory slot, DIRINDEX_EMPTY or DIRINDEX_DELETED
+    uint32_t mask;  // table size - 1, the size is a power of two
+    uint32_t tombstones;
+    int32_t *freeslots; // stack of unoccupied slots, lowest on top
+    uint32_t freecount;
+} directory_index;
+
+#define FAT_LOCKS 64 // FAT blocks b and b + FAT_LOCKS share a lock
+
+// reference counts by block number, see below
+typedef struct refcount_table
+{
+    uint32_t *blocks; // 0 for an empty slot
+    uint32_t *counts;
+    uint32_t mask; // table size - 1, the size is a power of two
+    uint32_t used; // slots taken
+} refcount_table;
+
+// tail packing, see below
+typedef struct tail_packer
+{
+    pthread_mutex_t lock;
+    uint32_t block; // pack block new tails go into, NO_START_BLOCK for none
+    uint32_t used;  // bytes of it taken
+    uint8_t *buf;   // its contents
+    refcount_table tails; // directory entries referring to each pack block
+} tail_packer;
+
+// metadata journal, see below
+typedef struct journal_keys
+{
+    uint32_t *keys; // may repeat
+    uint32_t count;
+    uint32_t capacity;
+} journal_keys;
+
+typedef struct metadata_journal
+{
+    bool active;         // changes are logged and committed
+    uint32_t generation; // bumped by every checkpoint
+    uint32_t sequence;   // of the next transaction
+    uint32_t head;       // next free journal block, block 0 is the header
+    pthread_rwlock_t oplock; // shared by changing operations, exclusive to commit
+    pthread_mutex_t lock;    // everything below
+    pthread_cond_t committed;
+    uint64_t ticket;  // operations finished
+    uint64_t durable; // operations covered by a finished commit
+    bool committing;  // a thread is writing the journal
+    bool overflow;    // a key list could not grow, the next commit checkpoints
+    // what changed since the last commit
+    journal_keys fat;      // block numbers
+    journal_keys bitmap;   // free map words
+    journal_keys dirslots; // directory slots
+    bool direxttouched;
+} metadata_journal;
+
+// asynchronous requests, see below
+typedef struct async_request
 {
+    struct async_request *next;
+    bool append;
+    int fd;
+    void *buf;
     int n;
-    int offset;
+    vsfs_callback callback;
+    void *arg;
+    int status;
+} async_request;
 
-    offset = k * BLOCKSIZE;
-    lseek(vs_fd, (off_t)offset, SEEK_SET);
+typedef struct async_worker
+{
+    struct vsfs *fs;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    async_request *head; // queued, in submission order
+    async_request *tail;
+    bool stop;
+} async_worker;
 
-    n = read(vs_fd, block, BLOCKSIZE);
+#define ASYNC_WORKERS 4 // fd goes to worker fd % ASYNC_WORKERS
 
-    if (n != BLOCKSIZE)
-    {
-        printf("read error\n");
-        return -1;
-    }
-    return (0);
+typedef struct async_engine
+{
+    pthread_mutex_t lock; // started and the completion queue
+    bool started;
+    async_worker workers[ASYNC_WORKERS];
+    async_request *donehead; // completed without a callback, oldest first
+    async_request *donetail;
+    int eventfd; // readable while the completion queue is not empty
+} async_engine;
+
+/**
+ * one mounted vdisk. locks, in the order they are taken:
+ * - lock: shared by the operations on one open file, exclusive for
+ *   vscreate, vsdelete, vssync and vsumount, which may touch anything
+ * - openlock: the free flags of the open file table, taken by vsopen
+ *   and vsclose only
+ * - openfiletable[fd].lock: the descriptor, its file's directory entry
+ *   and the FAT entries of the file's blocks
+ * - pack.lock: the tail packer, sharelock: the counts of shared blocks
+ * - allocator.lock, then metalock: the free map and the dirty flags
+ *   of the superblock and the directory blocks
+ * - fatlocks: the dirty flags of the FAT blocks, fat_set takes the lock
+ *   of the FAT block it changes
+ * - blockcache.lock, taken last
+ * journal.oplock is taken after lock and the descriptor lock by the
+ * operations that change metadata, and alone by the committing thread.
+ * journal.lock is taken last of all. the locks of the async engine are
+ * never held together with these.
+ */
+struct vsfs
+{
+    int fd; // file descriptor of the Linux file that acts as virtual disk.
+            // this is not visible to an application.
+    uint32_t blocksize; // from the superblock
+    vsfs_geometry geometry;
+    super_block superblock; // block 0 as read from a v1 disk
+    uint32_t *fattable;     // next block of every block, by block number
+    directory_entry *rootdir;
+    directory_table directory;
+    openfiletable_entry openfiletable[128];
+    uint8_t *map; // whole vdisk mapping when mounted with VSFS_MOUNT_MMAP
+    size_t mapsize;
+    // one dirty bit per metadata block, indexed by block number, for the
+    // blocks in front of geometry.firstdatablock
+    bool *metadata_dirty;
+    block_cache blockcache;
+    block_allocator allocator;
+    directory_index dirindex;
+    pthread_rwlock_t lock;
+    pthread_mutex_t openlock;
+    pthread_mutex_t metalock;
+    pthread_mutex_t fatlocks[FAT_LOCKS];
+    async_engine async;
+    metadata_journal journal;
+    tail_packer pack;
+    refcount_table shares; // owners of the blocks of cloned files, see below
+    pthread_mutex_t sharelock;
+    struct vsfs_stats stats; // updated with relaxed atomics, see vsfs_count
+};
+// ========================================================
+
+#ifdef STATS
+static uint64_t stats_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
 }
 
-// write block k into the virtual disk.
-int write_block(void *block, int k)
+// count a call to call that began at start in its latency histogram
+static void stats_latency(struct vsfs *fs, enum vsfs_call call, uint64_t start)
 {
-    int n;
-    int offset;
+    uint64_t elapsed = stats_clock() - start;
+    int bucket = 63 - __builtin_clzll(elapsed | 1);
+    if (bucket >= VSFS_LATENCY_BUCKETS)
+        bucket = VSFS_LATENCY_BUCKETS - 1;
+    __atomic_fetch_add(&fs->stats.calls[call], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs->stats.latencyns[call], elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs->stats.latency[call][bucket], 1, __ATOMIC_RELAXED);
+}
+#endif
 
-    offset = k * BLOCKSIZE;
-    lseek(vs_fd, (off_t)offset, SEEK_SET);
-    n = write(vs_fd, block, BLOCKSIZE);
-    if (n != BLOCKSIZE)
-    {
-        printf("write error\n");
-        return (-1);
-    }
+int vsfs_get_stats(vsfs_t *fs, struct vsfs_stats *stats)
+{
+#ifdef STATS
+    if (fs == NULL || stats == NULL)
+        return -1;
+    // every field is an unsigned long, loaded one at a time
+    unsigned long *from = (unsigned long *)&fs->stats;
+    unsigned long *to = (unsigned long *)stats;
+    for (size_t i = 0; i < sizeof(struct vsfs_stats) / sizeof(unsigned long); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
     return 0;
+#else
+    return -1;
+#endif
 }
 
-uint32_t get_nextfreeblock()
+// remember for the next journal commit that key changed
+static void journal_note(struct vsfs *fs, journal_keys *keys, uint32_t key)
 {
-    uint32_t from_basedatablock = 41;
-    for (int i = 0; i < FREEBLOCK_BITVECTOR_SIZE; i++)
+    if (!fs->journal.active)
+        return;
+    pthread_mutex_lock(&fs->journal.lock);
+    if (keys->count == keys->capacity)
     {
-        uint16_t currentportion = superblock.freeblock_bitvector[i];
-        for (int j = 0x0001; j <= 0x8000; j = j << 1)
+        uint32_t capacity = keys->capacity == 0 ? 64 : keys->capacity * 2;
+        uint32_t *grown = (uint32_t *)realloc(keys->keys, sizeof(uint32_t) * capacity);
+        if (grown == NULL)
         {
-            // cycle through all bits
-            // first ...0001 then ...0010 then ...0100 then ...1000
-            if ((uint16_t)(j)&currentportion)
-            {
-                // this block is available, mark unavailable
-                superblock.freeblock_bitvector[i] = currentportion & ~j;
-                return from_basedatablock;
-            }
-            from_basedatablock++;
-            // if reached max blocks count!
-            if (from_basedatablock == superblock.blockcount)
-                return 0;
+            fs->journal.overflow = true;
+            pthread_mutex_unlock(&fs->journal.lock);
+            return;
         }
+        keys->keys = grown;
+        keys->capacity = capacity;
     }
-    return 0;
+    keys->keys[keys->count++] = key;
+    pthread_mutex_unlock(&fs->journal.lock);
+}
+
+void mark_superblock_dirty(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->metalock);
+    fs->metadata_dirty[0] = true;
+    pthread_mutex_unlock(&fs->metalock);
+    if (fs->journal.active)
+    {
+        // only the directory extension changes in a v2 superblock
+        pthread_mutex_lock(&fs->journal.lock);
+        fs->journal.direxttouched = true;
+        pthread_mutex_unlock(&fs->journal.lock);
+    }
+}
+
+void mark_dirslot_dirty(struct vsfs *fs, int32_t slot)
+{
+    uint32_t block = slot / DIRENTRIES_PER_BLOCK(fs);
+    pthread_mutex_lock(&fs->metalock);
+    if (block < fs->geometry.rootdirblocks)
+        fs->metadata_dirty[fs->geometry.rootdirstart + block] = true;
+    else
+        fs->directory.dirty[block] = true;
+    pthread_mutex_unlock(&fs->metalock);
+    journal_note(fs, &fs->journal.dirslots, slot);
+}
+
+// metadata block that holds the FAT entry of blocknumber
+static uint32_t fat_diskblock(struct vsfs *fs, uint32_t blocknumber)
+{
+    if (fs->geometry.version == 1)
+        return fs->geometry.fatstart + FAT_BLOCK(blocknumber);
+    return fs->geometry.fatstart + blocknumber / FAT_ENTRIES_PER_BLOCK(fs);
 }
 
-int get_freeblockcount()
+// the entries of a chain belong to the file that holds it, so they need
+// no lock of their own; those of blocks shared by clones never change.
+// the dirty flag of a FAT block is shared between files and is taken
+// under the lock of its FAT block.
+uint32_t fat_get(struct vsfs *fs, uint32_t blocknumber)
 {
-    uint32_t from_basedatablock = 41;
-    int freeblockcount = 0;
-    for (int i = 0; i < FREEBLOCK_BITVECTOR_SIZE; i++)
+    return fs->fattable[blocknumber];
+}
+
+void fat_set(struct vsfs *fs, uint32_t blocknumber, uint32_t next)
+{
+    uint32_t diskblock = fat_diskblock(fs, blocknumber);
+    fs->fattable[blocknumber] = next;
+    pthread_mutex_lock(&fs->fatlocks[diskblock % FAT_LOCKS]);
+    fs->metadata_dirty[diskblock] = true;
+    pthread_mutex_unlock(&fs->fatlocks[diskblock % FAT_LOCKS]);
+    journal_note(fs, &fs->journal.fat, blocknumber);
+}
+
+// block after block in the chain of the file of entry, which may have
+// forked off its FAT chain. entry is NULL for a plain FAT chain.
+uint32_t file_nextblock(struct vsfs *fs, directory_entry *entry, uint32_t block)
+{
+    if (entry != NULL && (entry->flags & DIRENT_FORKED) && block == entry->forkblock)
+        return entry->forknext;
+    return fat_get(fs, block);
+}
+
+// transfer consecutive blocks starting at block k between the virtual
+// disk and the buffers of iov, bypassing the block cache. every buffer
+// holds a whole number of blocks. one preadv/pwritev at an absolute
+// offset moves the lot, more only on a short transfer. iov is consumed.
+// block numbers start from 0 in the virtual disk.
+int dev_transfer(struct vsfs *fs, struct iovec *iov, int iovcnt, uint32_t k, bool write)
+{
+    off_t offset = (off_t)k * fs->blocksize;
+    if (fs->map != NULL)
     {
-        uint16_t currentportion = superblock.freeblock_bitvector[i];
-        for (int j = 0x0001; j <= 0x8000; j = j << 1)
+        for (int i = 0; i < iovcnt; i++)
         {
-            if ((uint16_t)(j)&currentportion)
+            if (offset < 0 || (size_t)offset + iov[i].iov_len > fs->mapsize)
+            {
+                printf(write ? "write error\n" : "read error\n");
+                return -1;
+            }
+            if (write)
+            {
+                memcpy(fs->map + offset, iov[i].iov_base, iov[i].iov_len);
+                vsfs_count(fs, blockwrites, iov[i].iov_len / fs->blocksize);
+                vsfs_count(fs, byteswritten, iov[i].iov_len);
+            }
+            else
             {
-                freeblockcount++;
+                memcpy(iov[i].iov_base, fs->map + offset, iov[i].iov_len);
+                vsfs_count(fs, blockreads, iov[i].iov_len / fs->blocksize);
+                vsfs_count(fs, bytesread, iov[i].iov_len);
             }
-            from_basedatablock++;
-            if (from_basedatablock == superblock.blockcount)
-                break;
+            offset += iov[i].iov_len;
+        }
+        return 0;
+    }
+    while (iovcnt > 0)
+    {
+        ssize_t n = write ? pwritev(fs->fd, iov, iovcnt, offset)
+                          : preadv(fs->fd, iov, iovcnt, offset);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            printf(write ? "write error\n" : "read error\n");
+            return -1;
+        }
+        if (write)
+        {
+            vsfs_count(fs, writecalls, 1);
+            vsfs_count(fs, blockwrites, n / fs->blocksize);
+            vsfs_count(fs, byteswritten, n);
+        }
+        else
+        {
+            vsfs_count(fs, readcalls, 1);
+            vsfs_count(fs, blockreads, n / fs->blocksize);
+            vsfs_count(fs, bytesread, n);
+        }
+        offset += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
         }
     }
-    return freeblockcount;
+    return 0;
 }
 
-int get_freesize()
+// read block k from disk (virtual disk) into buffer block, bypassing
+// the block cache. size of the block is fs->blocksize.
+int dev_read_block(struct vsfs *fs, void *block, uint32_t k)
 {
-    return get_freeblockcount() * BLOCKSIZE;
+    struct iovec iov = {block, fs->blocksize};
+    return dev_transfer(fs, &iov, 1, k, false);
 }
 
-uint32_t get_lastallocatedblock(uint32_t startblock)
+// write block k into the virtual disk, bypassing the block cache.
+int dev_write_block(struct vsfs *fs, void *block, uint32_t k)
 {
-    if (startblock == NO_START_BLOCK)
-        return NO_START_BLOCK;
-    uint32_t fatblock = FAT_BLOCK(startblock);
-    uint32_t fatoffset = FAT_OFFSET(startblock);
-    uint32_t currfatentry = fattable[fatblock].entries[fatoffset];
-    uint32_t prevfatentry = startblock;
-    while (currfatentry != FAT_LIST_NULL)
+    struct iovec iov = {block, fs->blocksize};
+    return dev_transfer(fs, &iov, 1, k, true);
+}
+
+// let the kernel read count blocks from block k in the background, a
+// later read of them is then served from memory
+void dev_willneed(struct vsfs *fs, uint32_t k, uint32_t count)
+{
+    off_t offset = (off_t)k * fs->blocksize;
+    size_t length = (size_t)count * fs->blocksize;
+    vsfs_count(fs, advisecalls, 1);
+    if (fs->map != NULL)
     {
-        fatblock = FAT_BLOCK(prevfatentry);
-        fatoffset = FAT_OFFSET(prevfatentry);
-        prevfatentry = currfatentry;
-        currfatentry = fattable[fatblock].entries[fatoffset];
+        // madvise wants the start on a page boundary
+        off_t pagestart = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        madvise(fs->map + pagestart, length + (offset - pagestart), MADV_WILLNEED);
+        return;
     }
-    return prevfatentry;
+    posix_fadvise(fs->fd, offset, length, POSIX_FADV_WILLNEED);
 }
 
 /**********************************************************************
-  Utility Functions
+  Block cache
+  write-back LRU cache between read_block/write_block and the vdisk.
+  dirty buffers reach the disk in block order, either when a dirty
+  buffer is evicted or on vssync/vsumount. mmap mounts bypass it since
+  the mapping already lives in memory.
 ***********************************************************************/
-// #define PRINT_ROOTDIR
-#ifdef PRINT_ROOTDIR
-#define print_dir(func, ...) func(##__VA_ARGS__)
-#else
-#define print_dir(func) (void)0
-#endif
-void print_rootdir(void)
+static int cache_configuredsize = VSFS_CACHE_DEFAULT_BLOCKS; // for the next mount
+
+static void cache_lru_unlink(cache_buffer *buffer)
 {
-    for (int i = 0; i < 8; i++)
-    {
-        for (int j = 0; j < 16; j++)
-        {
-            directory_entry entry = rootdir[i].entries[j];
-            vsfs_info("formatted entry: isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
-                      entry.isoccupied, entry.startblock, entry.filesize, entry.filename);
-        }
-    }
+    buffer->prev->next = buffer->next;
+    buffer->next->prev = buffer->prev;
 }
 
-// #define PRINT_FATTABLE
-#ifdef PRINT_FATTABLE
-#define print_table(func, ...) func(##__VA_ARGS__)
-#else
-#define print_table(func) (void)0
-#endif
-void print_fattable(void)
+static void cache_lru_pushfront(struct vsfs *fs, cache_buffer *buffer)
 {
-    for (int i = 0; i < 32; i++)
-    {
-        for (int j = 0; j < 512; j++)
-        {
-            uint32_t entry = fattable[i].entries[j];
-            vsfs_info("entry in FAT block %d, offset %d is %u\n", i, j, entry);
-        }
-    }
+    buffer->next = fs->blockcache.lru.next;
+    buffer->prev = &fs->blockcache.lru;
+    fs->blockcache.lru.next->prev = buffer;
+    fs->blockcache.lru.next = buffer;
 }
 
-data_block *new_datablock()
+static void cache_lru_pushback(struct vsfs *fs, cache_buffer *buffer)
 {
-    data_block *block = (data_block *)calloc(1, sizeof(data_block));
-    return block;
+    buffer->prev = fs->blockcache.lru.prev;
+    buffer->next = &fs->blockcache.lru;
+    fs->blockcache.lru.prev->next = buffer;
+    fs->blockcache.lru.prev = buffer;
 }
-/**********************************************************************
-   The following functions are to be called by applications directly.
-***********************************************************************/
-int format_datablocks(int count)
+
+static cache_buffer **cache_bucket(struct vsfs *fs, uint32_t k)
 {
-    vsfs_assert(sizeof(data_block) == BLOCKSIZE);
-    data_block *newblock = new_datablock();
-    for (int i = 41; i < count; i++)
-    {
-        int status = write_block((void *)newblock, i);
-        if (status == -1)
-            return -1;
-    }
-    free(newblock);
-    return 0;
+    return &fs->blockcache.hash[(k * 2654435761u) & fs->blockcache.hashmask];
 }
 
-int format_fattable()
+static cache_buffer *cache_lookup(struct vsfs *fs, uint32_t k)
 {
-    vsfs_assert(sizeof(fat_table_block) == BLOCKSIZE);
-    size_t fat_entry_size = sizeof(uint32_t);
-    vsfs_assert(fat_entry_size == 4);
-    int perblockentry = BLOCKSIZE / fat_entry_size;
-    vsfs_assert(perblockentry == 512);
-    fat_table_block *block = (fat_table_block *)malloc(sizeof(fat_table_block));
-    vsfs_assert(sizeof(*block) == BLOCKSIZE);
-    for (int i = 0; i < perblockentry; i++)
-    {
-        block->entries[i] = FAT_LIST_NULL;
-    }
+    cache_buffer *buffer = *cache_bucket(fs, k);
+    while (buffer != NULL && buffer->blocknumber != k)
+        buffer = buffer->hashnext;
+    return buffer;
+}
 
-    for (int i = 1; i <= 32; i++)
-    {
-        int status = write_block((void *)block, i);
-        if (status == -1)
-            return -1;
-    }
-    free(block);
-    return 0;
+static void cache_unhash(struct vsfs *fs, cache_buffer *buffer)
+{
+    cache_buffer **link = cache_bucket(fs, buffer->blocknumber);
+    while (*link != buffer)
+        link = &(*link)->hashnext;
+    *link = buffer->hashnext;
+    buffer->valid = false;
 }
 
-int format_superblock(int count)
+static int cache_compare_dirty(const void *a, const void *b)
 {
-    vsfs_assert(sizeof(super_block) == BLOCKSIZE);
-    super_block *superblocktemp = (super_block *)malloc(sizeof(super_block));
-    superblocktemp->blockcount = count;
-    superblocktemp->blocksize = BLOCKSIZE;
-    for (int i = 0; i < 1528; i++)
-    {
-        superblocktemp->padding[i] = 0;
-    }
-    for (int i = 0; i < FREEBLOCK_BITVECTOR_SIZE; i++)
+    uint32_t x = (*(cache_buffer *const *)a)->blocknumber;
+    uint32_t y = (*(cache_buffer *const *)b)->blocknumber;
+    return (x > y) - (x < y);
+}
+
+// write the dirty buffers back, in ascending block order. runs of
+// consecutive dirty blocks go out with one pwritev each.
+static int cache_writeback(struct vsfs *fs, cache_buffer **dirty, int dirtycount)
+{
+    qsort(dirty, dirtycount, sizeof(cache_buffer *), cache_compare_dirty);
+    int status = 0;
+    struct iovec iov[64];
+    int runstart = 0;
+    for (int i = 0; i < dirtycount && status == 0; i++)
     {
-        superblocktemp->freeblock_bitvector[i] = UINT16_MAX;
+        int runlength = i - runstart + 1;
+        bool runends = i + 1 == dirtycount || runlength == 64 ||
+                       dirty[i + 1]->blocknumber != dirty[i]->blocknumber + 1;
+        if (!runends)
+            continue;
+        for (int j = 0; j < runlength; j++)
+        {
+            iov[j].iov_base = (void *)dirty[runstart + j]->data;
+            iov[j].iov_len = fs->blocksize;
+        }
+        status = dev_transfer(fs, iov, runlength, dirty[runstart]->blocknumber, true);
+        for (int j = 0; j < runlength && status == 0; j++)
+        {
+            dirty[runstart + j]->dirty = false;
+            fs->blockcache.stats.writebacks++;
+        }
+        runstart = i + 1;
     }
-    // set all the first 41 blocks to used, bit 0 to bit 40
-    // used by the file system
-    // superblock->freeblock_bitvector[0] = 0x0000; // 16 bits
-    // superblock->freeblock_bitvector[1] = 0x0000; // + 16 bits
-    // superblock->freeblock_bitvector[2] = 0x1100; // + 8 bits
-    // 40 bits
-    int status = write_block((void *)superblocktemp, 0);
-    if (status == -1)
-        return -1;
-    free(superblocktemp);
-    return 0;
+    return status;
 }
 
-int format_rootdir()
+// write every dirty buffer back. the caller holds the cache lock or the
+// whole mount.
+int cache_flush(struct vsfs *fs)
 {
-    // take the blocks indexed from 33 to 40 and initialize all directory entries to null
-    vsfs_assert(sizeof(root_dir_block) == BLOCKSIZE);
-    vsfs_info("directory entry size is: %ld\n", sizeof(directory_entry));
-    vsfs_assert(sizeof(directory_entry) == 128);
-
-    directory_entry entry;
-    entry.filesize = 0;
-    strncpy(entry.filename, "\0", sizeof(entry.filename));
-    entry.isoccupied = false;
-    entry.startblock = NO_START_BLOCK;
-    vsfs_assert(sizeof(entry) <= 128);
-    vsfs_info("formatted entry: isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
-              entry.isoccupied, entry.startblock, entry.filesize, entry.filename);
-    root_dir_block *block = (root_dir_block *)malloc(sizeof(root_dir_block));
-    vsfs_assert(sizeof(*block) == BLOCKSIZE);
-    for (int i = 0; i < 16; i++)
+    if (fs->blockcache.size == 0)
+        return 0;
+    cache_buffer **dirty = (cache_buffer **)malloc(sizeof(cache_buffer *) * fs->blockcache.size);
+    if (dirty == NULL)
+        return -1;
+    int dirtycount = 0;
+    for (int i = 0; i < fs->blockcache.size; i++)
     {
-        memcpy(block->entries + i, &entry, sizeof(directory_entry));
+        if (fs->blockcache.buffers[i].valid && fs->blockcache.buffers[i].dirty)
+            dirty[dirtycount++] = &fs->blockcache.buffers[i];
     }
+    int status = cache_writeback(fs, dirty, dirtycount);
+    free(dirty);
+    return status;
+}
 
-    for (int i = 33; i <= 40; i++)
+// write back the dirty buffers of the blocks in the chain of entry
+// starting at startblock, with the cache lock held
+int cache_flushchain(struct vsfs *fs, directory_entry *entry, uint32_t startblock)
+{
+    if (fs->blockcache.size == 0)
+        return 0;
+    cache_buffer **dirty = (cache_buffer **)malloc(sizeof(cache_buffer *) * fs->blockcache.size);
+    if (dirty == NULL)
+        return -1;
+    int dirtycount = 0;
+    for (uint32_t b = startblock; b != FAT_LIST_NULL && dirtycount < fs->blockcache.size; b = file_nextblock(fs, entry, b))
     {
-        int status = write_block(block, i);
-        if (status == -1)
-            return -1;
+        cache_buffer *buffer = cache_lookup(fs, b);
+        if (buffer != NULL && buffer->dirty)
+            dirty[dirtycount++] = buffer;
     }
-    free(block);
-    return 0;
+    int status = cache_writeback(fs, dirty, dirtycount);
+    free(dirty);
+    return status;
 }
 
-// this function is partially implemented.
-int vsformat(char *vdiskname, unsigned int m)
+// take the least recently used buffer for block k, writing dirty
+// buffers back first if it is dirty
+static cache_buffer *cache_victim(struct vsfs *fs, uint32_t k)
 {
-    // validate m, max disksize is 2^23 bytes and min disksize is 2^18 bytes
-    if (m < 18 || m > 23)
+    cache_buffer *buffer = fs->blockcache.lru.prev;
+    if (buffer->valid)
     {
-        vsfs_err("m value must be between 18 and 23 only\n");
-        return -1;
+        if (buffer->dirty && cache_flush(fs) == -1)
+            return NULL;
+        cache_unhash(fs, buffer);
+        fs->blockcache.stats.evictions++;
     }
-    int size;
-    int num = 1;
-    int count;
-    size = num << m;
-    count = size / BLOCKSIZE;
-    vsfs_info("%d %d\n", m, size);
+    buffer->blocknumber = k;
+    buffer->valid = true;
+    buffer->dirty = false;
+    cache_buffer **bucket = cache_bucket(fs, k);
+    buffer->hashnext = *bucket;
+    *bucket = buffer;
+    return buffer;
+}
 
-    // memory map disk
-    vs_fd = open(vdiskname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (ftruncate(vs_fd, size) != 0)
+void cache_destroy(struct vsfs *fs)
+{
+    free(fs->blockcache.buffers);
+    free(fs->blockcache.data);
+    free(fs->blockcache.hash);
+    fs->blockcache.buffers = NULL;
+    fs->blockcache.data = NULL;
+    fs->blockcache.hash = NULL;
+    fs->blockcache.size = 0;
+}
+
+// set up size buffers of blocksize bytes
+int cache_init(struct vsfs *fs, int size)
+{
+    memset(&fs->blockcache.stats, 0, sizeof(fs->blockcache.stats));
+    fs->blockcache.lru.next = &fs->blockcache.lru;
+    fs->blockcache.lru.prev = &fs->blockcache.lru;
+    if (size <= 0)
+        return 0;
+    uint32_t hashsize = 1;
+    while (hashsize < (uint32_t)size * 2)
+        hashsize <<= 1;
+    fs->blockcache.buffers = (cache_buffer *)calloc(size, sizeof(cache_buffer));
+    fs->blockcache.data = (uint8_t *)malloc((size_t)size * fs->blocksize);
+    fs->blockcache.hash = (cache_buffer **)calloc(hashsize, sizeof(cache_buffer *));
+    if (fs->blockcache.buffers == NULL || fs->blockcache.data == NULL || fs->blockcache.hash == NULL)
     {
-        vsfs_err("failed to truncate vdisk\n");
+        cache_destroy(fs);
         return -1;
     }
-
-    struct stat sb;
-    if (fstat(vs_fd, &sb))
+    fs->blockcache.hashmask = hashsize - 1;
+    fs->blockcache.size = size;
+    for (int i = 0; i < size; i++)
     {
-        vsfs_err("failed to get vdisk size info\n");
-        return -1;
+        fs->blockcache.buffers[i].data = fs->blockcache.data + (size_t)i * fs->blocksize;
+        cache_lru_pushfront(fs, &fs->blockcache.buffers[i]);
     }
-    vsfs_info("vsdisk size: %ld\n", sb.st_size);
-    vsfs_assert(sb.st_size == size);
-    int status;
-    status = format_superblock(count);
-    if (status == -1)
-        return -1;
-
-    vsfs_info("here 1\n");
-    status = format_rootdir();
-    if (status == -1)
-        return -1;
-    status = format_fattable(count);
-    if (status == -1)
-        return -1;
-
-    status = format_datablocks(count);
-    if (status == -1)
-        return -1;
-    close(vs_fd);
-    return (0);
+    return 0;
 }
 
-// this function is partially implemented.
-int vsmount(char *vdiskname)
+// read block k into buffer block, through the block cache.
+// size of the block is fs->blocksize.
+// space for block must be allocated outside of this function.
+// block numbers start from 0 in the virtual disk.
+static int cache_read(struct vsfs *fs, void *block, uint32_t k)
 {
-    for (int i = 0; i < 128; i++)
+    cache_buffer *buffer = cache_lookup(fs, k);
+    if (buffer != NULL)
     {
-        openfiletable[i].free = true;
+        fs->blockcache.stats.hits++;
     }
-    // open the Linux file vdiskname and in this
-    // way make it ready to be used for other operations.
-    // vs_fd is global; hence other function can use it.
-    vs_fd = open(vdiskname, O_RDWR);
-    // load (chache) the superblock info from disk (Linux file) into memory
-    // load the FAT table from disk into memory
-    // load root directory from disk into memory
-
-    int status = read_block((void *)(&superblock), 0);
-    if (status == -1)
-        return -1;
-    vsfs_info("on mount, superblock block count: %d\n", superblock.blockcount);
-    vsfs_info("on mount, superblock block size: %d\n", superblock.blocksize);
-
-    for (int i = 33; i <= 40; i++)
+    else
     {
-        status = read_block(rootdir + (i - 33), i);
-        if (status == -1)
+        fs->blockcache.stats.misses++;
+        buffer = cache_victim(fs, k);
+        if (buffer == NULL)
+            return -1;
+        if (dev_read_block(fs, (void *)buffer->data, k) == -1)
         {
+            cache_unhash(fs, buffer);
             return -1;
         }
     }
-    // print_dir(print_rootdir);
-
-    for (int i = 1; i <= 32; i++)
-    {
-        status = read_block(fattable + (i - 1), i);
-        if (status == -1)
-            return -1;
-    }
-    print_table(print_fattable);
-
+    cache_lru_unlink(buffer);
+    cache_lru_pushfront(fs, buffer);
+    memcpy(block, buffer->data, fs->blocksize);
     return (0);
 }
 
-// this function is partially implemented.
-int vsumount()
+int read_block(struct vsfs *fs, void *block, uint32_t k)
 {
-    // write superblock to virtual disk file
-    int status = write_block((void *)(&superblock), 0);
-    if (status == -1)
-        return -1;
-    // write FAT to virtual disk file
-    for (int i = 1; i <= 32; i++)
-    {
-        status = write_block(fattable + (i - 1), i);
-        if (status == -1)
-            return -1;
-    }
+    if (fs->blockcache.size == 0)
+        return dev_read_block(fs, block, k);
+    pthread_mutex_lock(&fs->blockcache.lock);
+    int status = cache_read(fs, block, k);
+    pthread_mutex_unlock(&fs->blockcache.lock);
+    return status;
+}
 
-    // write root directory to virtual disk file
-    for (int i = 33; i <= 40; i++)
+// write block k into the virtual disk, through the block cache.
+// the block reaches the disk when it is evicted or on vssync/vsumount.
+static int cache_write(struct vsfs *fs, void *block, uint32_t k)
+{
+    cache_buffer *buffer = cache_lookup(fs, k);
+    if (buffer == NULL)
     {
-        status = write_block(rootdir + (i - 33), i);
-        if (status == -1)
+        // the whole block is overwritten, nothing to read in
+        buffer = cache_victim(fs, k);
+        if (buffer == NULL)
             return -1;
     }
+    cache_lru_unlink(buffer);
+    cache_lru_pushfront(fs, buffer);
+    memcpy(buffer->data, block, fs->blocksize);
+    buffer->dirty = true;
+    return 0;
+}
 
-    fsync(vs_fd); // synchronize kernel file cache with the disk
-    close(vs_fd);
-    return (0);
+int write_block(struct vsfs *fs, void *block, uint32_t k)
+{
+    if (fs->blockcache.size == 0)
+        return dev_write_block(fs, block, k);
+    pthread_mutex_lock(&fs->blockcache.lock);
+    int status = cache_write(fs, block, k);
+    pthread_mutex_unlock(&fs->blockcache.lock);
+    return status;
 }
 
-int vscreate(char *filename)
+// drop the cached copy of block k, which is given back to the free pool
+// or written around the cache from now on. a dirty copy is written back
+// first, vsdelete relies on its zeroes reaching the disk.
+int cache_forget(struct vsfs *fs, uint32_t k)
 {
-    int length = strlen(filename);
-    if (length >= 30)
+    if (fs->blockcache.size == 0)
+        return 0;
+    pthread_mutex_lock(&fs->blockcache.lock);
+    int status = 0;
+    cache_buffer *buffer = cache_lookup(fs, k);
+    if (buffer != NULL)
     {
-        return -1;
+        if (buffer->dirty)
+            status = cache_writeback(fs, &buffer, 1);
+        if (status == 0)
+        {
+            cache_unhash(fs, buffer);
+            buffer->dirty = false;
+            // reused before any buffer still holding a block
+            cache_lru_unlink(buffer);
+            cache_lru_pushback(fs, buffer);
+        }
     }
+    pthread_mutex_unlock(&fs->blockcache.lock);
+    return status;
+}
 
-    vsfs_info("creating file with name %s\n", filename);
-    for (int i = 0; i < 8; i++)
+/**********************************************************************
+  Block I/O batches
+  the data path queues the blocks an operation touches and the batch
+  sends each run of consecutive blocks with one preadv/pwritev. buffers
+  that are adjacent in memory share an iovec. batches go around the
+  block cache but stay coherent with it: a read takes blocks that are
+  cached from the cache, a write refreshes the cached copies. a written
+  run of at most half the cache leaves clean copies behind, longer runs,
+  the bulk of large appends, write around the cache so that they do not
+  push out the blocks in use.
+***********************************************************************/
+#define BATCH_IOV_MAX 64
+
+typedef struct blockio_batch
+{
+    bool write;
+    uint32_t firstblock; // first block of the queued run
+    uint32_t blockcount; // blocks in the queued run
+    int iovcnt;
+    struct iovec iov[BATCH_IOV_MAX];
+} blockio_batch;
+
+void batch_init(blockio_batch *batch, bool write)
+{
+    batch->write = write;
+    batch->firstblock = 0;
+    batch->blockcount = 0;
+    batch->iovcnt = 0;
+}
+
+// send the queued run to the disk
+int batch_submit(struct vsfs *fs, blockio_batch *batch)
+{
+    if (batch->blockcount == 0)
+        return 0;
+    int status = 0;
+    int cached = 0;
+    if (fs->blockcache.size != 0)
     {
-        for (int j = 0; j < 16; j++)
+        // walk the run block by block against the cache
+        pthread_mutex_lock(&fs->blockcache.lock);
+        uint32_t k = batch->firstblock;
+        for (int i = 0; i < batch->iovcnt; i++)
         {
-            directory_entry *entry = &rootdir[i].entries[j];
-            if (entry->isoccupied)
+            for (size_t done = 0; done < batch->iov[i].iov_len; done += fs->blocksize, k++)
             {
-                if (strcmp(entry->filename, filename) == 0)
+                cache_buffer *buffer = cache_lookup(fs, k);
+                if (buffer == NULL)
+                    continue;
+                cached++;
+                if (batch->write)
                 {
-                    return -1;
+                    memcpy(buffer->data, (uint8_t *)batch->iov[i].iov_base + done, fs->blocksize);
+                    buffer->dirty = false;
                 }
             }
         }
+        if (!batch->write)
+        {
+            fs->blockcache.stats.hits += cached;
+            fs->blockcache.stats.misses += batch->blockcount - cached;
+        }
+        pthread_mutex_unlock(&fs->blockcache.lock);
     }
-
-    for (int i = 0; i < 8; i++)
+    if (batch->write || cached != (int)batch->blockcount)
+    {
+        struct iovec iov[BATCH_IOV_MAX];
+        memcpy(iov, batch->iov, sizeof(struct iovec) * batch->iovcnt);
+        status = dev_transfer(fs, iov, batch->iovcnt, batch->firstblock, batch->write);
+    }
+    if (status == 0 && batch->write && fs->blockcache.size != 0 &&
+        batch->blockcount <= (uint32_t)fs->blockcache.size / 2)
     {
-        for (int j = 0; j < 16; j++)
+        pthread_mutex_lock(&fs->blockcache.lock);
+        uint32_t k = batch->firstblock;
+        for (int i = 0; i < batch->iovcnt; i++)
         {
-            directory_entry *entry = &rootdir[i].entries[j];
-            if (!entry->isoccupied)
+            for (size_t done = 0; done < batch->iov[i].iov_len; done += fs->blocksize, k++)
             {
-                entry->isoccupied = true;
-                strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
-                entry->filename[sizeof(entry->filename) - 1] = '\0';
-                vsfs_info("vscreate: file-> isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
-                          entry->isoccupied, entry->startblock, entry->filesize, entry->filename);
-                return 0;
+                if (cache_lookup(fs, k) != NULL)
+                    continue;
+                cache_buffer *buffer = cache_victim(fs, k);
+                if (buffer == NULL)
+                    break;
+                memcpy(buffer->data, (uint8_t *)batch->iov[i].iov_base + done, fs->blocksize);
+                cache_lru_unlink(buffer);
+                cache_lru_pushfront(fs, buffer);
             }
         }
+        pthread_mutex_unlock(&fs->blockcache.lock);
     }
-    return -1;
-}
-
-int vsopen(char *file, int mode)
-{
-    // if have already allocated all the files
-    int tableoffset = 0;
-    for (int i = 0; i < 8; i++)
+    if (status == 0 && !batch->write && cached != 0)
     {
-        for (int j = 0; j < 16; j++)
+        // cached blocks may be newer than what is on disk
+        pthread_mutex_lock(&fs->blockcache.lock);
+        uint32_t k = batch->firstblock;
+        for (int i = 0; i < batch->iovcnt; i++)
         {
-            directory_entry *entry = &rootdir[i].entries[j];
-            if (strcmp(entry->filename, file) == 0)
+            for (size_t done = 0; done < batch->iov[i].iov_len; done += fs->blocksize, k++)
             {
-                // if already opened, check for mode
-                if (!openfiletable[tableoffset].free &&
-                    openfiletable[tableoffset].mode != mode)
-                {
-                    return -1;
-                }
-                openfiletable[tableoffset].entry = entry;
-                openfiletable[tableoffset].mode = mode;
-                openfiletable[tableoffset].free = false;
-
-                directory_entry *openentry = openfiletable[tableoffset].entry;
-                vsfs_info("vsopen: file-> isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
-                          openentry->isoccupied, openentry->startblock, openentry->filesize, openentry->filename);
-                return tableoffset;
+                cache_buffer *buffer = cache_lookup(fs, k);
+                if (buffer != NULL)
+                    memcpy((uint8_t *)batch->iov[i].iov_base + done, buffer->data, fs->blocksize);
             }
-            tableoffset++;
         }
+        pthread_mutex_unlock(&fs->blockcache.lock);
     }
-    return -1;
+    batch->blockcount = 0;
+    batch->iovcnt = 0;
+    return status;
 }
 
-int vsclose(int fd)
+// queue count consecutive blocks starting at block k, buffer holds
+// count * fs->blocksize bytes. the queued run is sent first when block k
+// does not continue it.
+int batch_add(struct vsfs *fs, blockio_batch *batch, void *buffer, uint32_t k, uint32_t count)
 {
-    if (fd < 0 && fd > 128)
-        return -1;
-    if (openfiletable[fd].free)
-        return -1;
-    openfiletable[fd].free = true;
-    return (0);
+    size_t length = (size_t)count * fs->blocksize;
+    if (batch->blockcount != 0)
+    {
+        struct iovec *last = &batch->iov[batch->iovcnt - 1];
+        bool continuesrun = batch->firstblock + batch->blockcount == k;
+        if (continuesrun && (uint8_t *)last->iov_base + last->iov_len == (uint8_t *)buffer)
+        {
+            last->iov_len += length;
+            batch->blockcount += count;
+            return 0;
+        }
+        if (!continuesrun || batch->iovcnt == BATCH_IOV_MAX)
+        {
+            if (batch_submit(fs, batch) == -1)
+                return -1;
+        }
+    }
+    if (batch->blockcount == 0)
+        batch->firstblock = k;
+    batch->iov[batch->iovcnt].iov_base = buffer;
+    batch->iov[batch->iovcnt].iov_len = length;
+    batch->iovcnt++;
+    batch->blockcount += count;
+    return 0;
 }
 
-int vssize(int fd)
+int vscache_setsize(int blockcount)
 {
-    if (fd < 0 && fd > 128)
-        return -1;
-    if (openfiletable[fd].free == true)
+    if (blockcount < 0)
         return -1;
-    return openfiletable[fd].entry->filesize;
+    cache_configuredsize = blockcount;
+    return 0;
 }
 
-int vsread(int fd, void *buf, int n)
+int vsfs_cache_stats(vsfs_t *fs, struct vsfs_cachestats *stats)
 {
-    if (fd < 0 || fd > 128)
-        return -1;
-    if (openfiletable[fd].free == true)
-        return -1;
-    if (openfiletable[fd].mode != MODE_READ)
+    if (fs == NULL || stats == NULL)
         return -1;
+    pthread_mutex_lock(&fs->blockcache.lock);
+    *stats = fs->blockcache.stats;
+    pthread_mutex_unlock(&fs->blockcache.lock);
+    return 0;
+}
 
-    if (openfiletable[fd].entry->filesize == 0)
-    {
-        vsfs_assert(openfiletable[fd].entry->startblock == NO_START_BLOCK);
-        return 0;
-    }
+/**********************************************************************
+  Free block allocator
+  the free map has bit b % 64 of word b / 64 set when block b is free,
+  so that a free block is found with one count-trailing-zeros per word.
+  it is loaded on mount from the bitmap blocks of a v2 disk (a bit set
+  per used block) or from the bit vector in a v1 superblock (a bit set
+  per free data block, bit i is block 41 + i), and the free count is kept
+  up to date as blocks are taken and released.
+***********************************************************************/
+// words of the free map, on v2 disks it spans the whole bitmap blocks
+// so that they can be read straight into it
+static uint32_t allocator_words(struct vsfs *fs)
+{
+    if (fs->geometry.version == 1)
+        return (fs->geometry.blockcount + 63) / 64;
+    return fs->geometry.bitmapblocks * (fs->blocksize / 8);
+}
 
-    vsfs_info("reading file %s\n", openfiletable[fd].entry->filename);
-    // map buffer to underyling bytestream
-    uint8_t *bytestream = (uint8_t *)buf;
+static void freemap_clear(struct vsfs *fs, uint32_t start, uint32_t end)
+{
+    for (uint32_t b = start; b < end; b++)
+        fs->allocator.freemap[b / 64] &= ~(UINT64_C(1) << (b % 64));
+}
 
-    data_block *datablock = new_datablock();
-    int datablockindex = 0;
-    uint32_t currblocknumber = openfiletable[fd].entry->startblock;
-    int readstatus = read_block((void *)datablock, currblocknumber);
-    if (readstatus == -1)
-        return -1;
-    for (int i = 0; i < n; i++)
+// build the free map from the on-disk bitmap, which has been read into
+// freemap on v2 disks
+void allocator_load(struct vsfs *fs)
+{
+    fs->allocator.hint = 0;
+    fs->allocator.freecount = 0;
+    if (fs->geometry.version == 1)
     {
-        datablockindex = i % BLOCKSIZE;
-        bytestream[i] = datablock->data[datablockindex];
-        vsfs_info("read value %x\n", bytestream[i]);
-        if (datablockindex == BLOCKSIZE - 1)
+        uint32_t datablocks = fs->geometry.blockcount - fs->geometry.firstdatablock;
+        if (datablocks > MAX_BLOCK_COUNT)
+            datablocks = MAX_BLOCK_COUNT;
+        for (uint32_t i = 0; i < datablocks; i++)
         {
-            currblocknumber = fattable[FAT_BLOCK(currblocknumber)].entries[FAT_OFFSET(currblocknumber)];
-            if (currblocknumber == FAT_LIST_NULL)
+            if (fs->superblock.freeblock_bitvector[i / 16] & (1u << (i % 16)))
             {
-                break;
+                uint32_t b = fs->geometry.firstdatablock + i;
+                fs->allocator.freemap[b / 64] |= UINT64_C(1) << (b % 64);
             }
-            int readstatus = read_block((void *)datablock, currblocknumber);
-            if (readstatus == -1)
-                return -1;
         }
     }
+    else
+    {
+        for (uint32_t w = 0; w < fs->allocator.words; w++)
+            fs->allocator.freemap[w] = ~fs->allocator.freemap[w];
+    }
+    // metadata and blocks past the end of the disk are never free
+    freemap_clear(fs, 0, fs->geometry.firstdatablock);
+    freemap_clear(fs, fs->geometry.blockcount, fs->allocator.words * 64);
+    for (uint32_t w = 0; w < fs->allocator.words; w++)
+        fs->allocator.freecount += __builtin_popcountll(fs->allocator.freemap[w]);
+}
+
+// flip the bit of block blocknumber and mark the on-disk bitmap block
+// holding it dirty. the caller holds the allocator lock, which also
+// covers the dirty flags of the bitmap blocks.
+static void allocator_setbit(struct vsfs *fs, uint32_t blocknumber, bool isfree)
+{
+    uint64_t mask = UINT64_C(1) << (blocknumber % 64);
+    if (isfree)
+        fs->allocator.freemap[blocknumber / 64] |= mask;
+    else
+        fs->allocator.freemap[blocknumber / 64] &= ~mask;
+    if (fs->geometry.version == 1)
+        mark_superblock_dirty(fs);
+    else
+        fs->metadata_dirty[fs->geometry.bitmapstart + blocknumber / BITMAP_BITS_PER_BLOCK(fs)] = true;
+    journal_note(fs, &fs->journal.bitmap, blocknumber / 64);
+}
+
+static uint32_t allocator_takeblock(struct vsfs *fs)
+{
+    vsfs_count(fs, allocations, 1);
+    if (fs->allocator.freecount == 0)
+        return 0;
+    // next fit: continue from the word of the previous allocation
+    for (uint32_t n = 0; n < fs->allocator.words; n++)
+    {
+        uint32_t w = fs->allocator.hint + n;
+        if (w >= fs->allocator.words)
+            w -= fs->allocator.words;
+        uint64_t word = fs->allocator.freemap[w];
+        if (word == 0)
+            continue;
+        vsfs_count(fs, bitsscanned, (unsigned long)(n + 1) * 64);
+        uint32_t blocknumber = w * 64 + __builtin_ctzll(word);
+        allocator_setbit(fs, blocknumber, false);
+        fs->allocator.freecount--;
+        fs->allocator.hint = w;
+        return blocknumber;
+    }
+    vsfs_count(fs, bitsscanned, (unsigned long)fs->allocator.words * 64);
     return 0;
 }
 
-void itervative_append(
-    uint32_t currblock,
-    uint32_t prevblock,
-    int endingstreamidx,
-    uint8_t *bytestream,
-    int startingstreamidx)
+// returns the block number of a newly reserved block, 0 if the disk is full
+uint32_t get_nextfreeblock(struct vsfs *fs)
 {
-    data_block *datablock = new_datablock();
-    int datablockindex = 0;
-    uint32_t currblocknumber = currblock;
-    uint32_t prevblocknumber = prevblock;
-    fattable[FAT_BLOCK(prevblocknumber)].entries[FAT_OFFSET(prevblocknumber)] = currblocknumber;
-    fattable[FAT_BLOCK(currblocknumber)].entries[FAT_OFFSET(currblocknumber)] = FAT_LIST_NULL;
-    bool flagnewblock = false;
-    for (int i = 0; i < endingstreamidx; i++)
+    pthread_mutex_lock(&fs->allocator.lock);
+    uint32_t blocknumber = allocator_takeblock(fs);
+    pthread_mutex_unlock(&fs->allocator.lock);
+    return blocknumber;
+}
+
+// first block at or after index whose free bit equals isfree, or the
+// end of the map when there is none
+static uint32_t freemap_find(struct vsfs *fs, uint32_t index, bool isfree)
+{
+    uint32_t total = fs->allocator.words * 64;
+    uint32_t first = index / 64;
+    while (index < total)
     {
-        if (flagnewblock)
+        uint64_t word = fs->allocator.freemap[index / 64];
+        if (!isfree)
+            word = ~word;
+        word &= ~UINT64_C(0) << (index % 64);
+        if (word != 0)
         {
-            prevblocknumber = currblocknumber;
-            currblocknumber = get_nextfreeblock();
-            fattable[FAT_BLOCK(prevblocknumber)].entries[FAT_OFFSET(prevblocknumber)] = currblocknumber;
-            fattable[FAT_BLOCK(currblocknumber)].entries[FAT_OFFSET(currblocknumber)] = FAT_LIST_NULL;
-            flagnewblock = false;
+            vsfs_count(fs, bitsscanned, (unsigned long)(index / 64 - first + 1) * 64);
+            return (index / 64) * 64 + __builtin_ctzll(word);
         }
-        datablockindex = i % BLOCKSIZE;
-        if (startingstreamidx != 0)
-        {
-            datablock->data[datablockindex] = bytestream[startingstreamidx + i + 1];
-        }
-        else
-        {
-            datablock->data[datablockindex] = bytestream[i];
-        }
-        if (datablockindex == BLOCKSIZE - 1)
-        {
-            // if was last element to write, flush current data block to disk
-            write_block((void *)datablock, currblocknumber);
-            flagnewblock = true;
-        }
-    }
-    if (flagnewblock == false)
-    {
-        // the current written block was not flushed
-        fattable[FAT_BLOCK(prevblocknumber)].entries[FAT_OFFSET(prevblocknumber)] = currblocknumber;
-        write_block((void *)datablock, currblocknumber);
+        index = (index / 64 + 1) * 64;
     }
-    free(datablock);
+    if (total / 64 > first)
+        vsfs_count(fs, bitsscanned, (unsigned long)(total / 64 - first) * 64);
+    return total;
 }
 
-int vsappend(int fd, void *buf, int n)
+static uint32_t allocator_takeextent(struct vsfs *fs, uint32_t want, uint32_t goal, uint32_t *count)
 {
-    if (fd < 0 || fd > 128)
-        return -1;
-    if (openfiletable[fd].free == true)
-        return -1;
-    if (openfiletable[fd].mode != MODE_APPEND)
-        return -1;
-
-    // map the underlying buffer to a byte stream
-    uint8_t *bytestream = (uint8_t *)malloc(sizeof(uint8_t) * n);
-    memcpy(bytestream, buf, sizeof(uint8_t) * n);
+    *count = 0;
+    vsfs_count(fs, allocations, 1);
+    if (fs->allocator.freecount == 0 || want == 0)
+        return 0;
+    uint32_t total = fs->allocator.words * 64;
+    uint32_t runstart = total;
+    uint32_t runlength = 0;
 
-    uint32_t startblock = openfiletable[fd].entry->startblock;
-    uint32_t lastallocatedblock = get_lastallocatedblock(startblock);
-    if (lastallocatedblock == NO_START_BLOCK)
+    if (goal != 0 && goal < total && freemap_find(fs, goal, true) == goal)
     {
-        vsfs_assert(openfiletable[fd].entry->filesize == 0);
-        openfiletable[fd].entry->startblock = get_nextfreeblock();
-
-        itervative_append(
-            openfiletable[fd].entry->startblock,
-            0,
-            n,
-            bytestream,
-            0);
-        openfiletable[fd].entry->filesize = n;
-        free(bytestream);
-        return 0;
+        runstart = goal;
+        runlength = freemap_find(fs, runstart, false) - runstart;
     }
     else
     {
-        // check if the lastallocatedblock still has available space
-        uintmax_t currsize = openfiletable[fd].entry->filesize;
-        bool haslastblockspace = currsize % BLOCKSIZE != 0;
-        if (haslastblockspace)
-        {
-            fflush(stdout);
-            // load the old block
-            data_block *datablock = new_datablock();
-            int readstatus = read_block((void *)datablock, lastallocatedblock);
-            uintmax_t availablelastblocksize = BLOCKSIZE - (currsize % BLOCKSIZE);
-            off_t lastblockoffset = (currsize % BLOCKSIZE);
-            fflush(stdout);
-            vsfs_assert(availablelastblocksize < BLOCKSIZE && availablelastblocksize > 0);
-            if (availablelastblocksize >= n)
-            {
-                for (int i = 0; i < n; i++)
-                {
-                    datablock->data[lastblockoffset] = bytestream[i];
-                    lastblockoffset++;
-                }
-                write_block((void *)datablock, lastallocatedblock);
-                free(datablock);
-                free(bytestream);
-                openfiletable[fd]
-                    .entry->filesize = currsize + n;
-                return 0;
-            }
-            else
+        // scan runs from the hint to the end, then from the start to the hint
+        uint32_t bounds[2][2] = {{fs->allocator.hint * 64, total}, {0, fs->allocator.hint * 64}};
+        for (int pass = 0; pass < 2 && runlength < want; pass++)
+        {
+            uint32_t index = bounds[pass][0];
+            while (index < bounds[pass][1])
             {
-                int bytestreamidx = 0;
-                for (; bytestreamidx < availablelastblocksize; bytestreamidx++)
+                uint32_t start = freemap_find(fs, index, true);
+                if (start >= bounds[pass][1])
+                    break;
+                uint32_t end = freemap_find(fs, start, false);
+                if (end - start > runlength)
                 {
-                    datablock->data[lastblockoffset] = bytestream[bytestreamidx];
-                    lastblockoffset++;
+                    runstart = start;
+                    runlength = end - start;
+                    if (runlength >= want)
+                        break;
                 }
-                // block is completely full
-                write_block((void *)datablock, lastallocatedblock);
-                // start allocating blocks
-                free(datablock);
-                itervative_append(
-                    get_nextfreeblock(),
-                    lastallocatedblock,
-                    (n - bytestreamidx - 1),
-                    bytestream,
-                    bytestreamidx);
-                openfiletable[fd].entry->filesize = currsize + n;
-                free(datablock);
-                free(bytestream);
-                return 0;
+                index = end;
             }
         }
-        else
+    }
+    if (runlength == 0)
+        return 0;
+    if (runlength > want)
+        runlength = want;
+    for (uint32_t i = 0; i < runlength; i++)
+        allocator_setbit(fs, runstart + i, false);
+    fs->allocator.freecount -= runlength;
+    fs->allocator.hint = (runstart + runlength - 1) / 64;
+    *count = runlength;
+    return runstart;
+}
+
+// reserve up to want contiguous blocks, preferring a run that starts at
+// block goal (pass 0 for no preference), then the first run long enough,
+// then the longest run there is. returns the first block of the run and
+// its length in *count, 0 if the disk is full.
+uint32_t get_freeextent(struct vsfs *fs, uint32_t want, uint32_t goal, uint32_t *count)
+{
+    pthread_mutex_lock(&fs->allocator.lock);
+    uint32_t runstart = allocator_takeextent(fs, want, goal, count);
+    pthread_mutex_unlock(&fs->allocator.lock);
+    return runstart;
+}
+
+// give a data block back to the free pool
+void release_block(struct vsfs *fs, uint32_t blocknumber)
+{
+    vsfs_assert(blocknumber >= fs->geometry.firstdatablock);
+    // the block may come back as a directory block, which is written
+    // around the cache
+    if (cache_forget(fs, blocknumber) == -1)
+        vsfs_err("failed to write back block %u\n", blocknumber);
+    pthread_mutex_lock(&fs->allocator.lock);
+    if (!(fs->allocator.freemap[blocknumber / 64] & (UINT64_C(1) << (blocknumber % 64))))
+    {
+        allocator_setbit(fs, blocknumber, true);
+        fs->allocator.freecount++;
+    }
+    pthread_mutex_unlock(&fs->allocator.lock);
+}
+
+uint32_t get_freeblockcount(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->allocator.lock);
+    uint32_t freecount = fs->allocator.freecount;
+    pthread_mutex_unlock(&fs->allocator.lock);
+    return freecount;
+}
+
+uintmax_t get_freesize(struct vsfs *fs)
+{
+    return (uintmax_t)get_freeblockcount(fs) * fs->blocksize;
+}
+
+uint32_t get_lastallocatedblock(struct vsfs *fs, directory_entry *entry)
+{
+    if (entry->startblock == NO_START_BLOCK)
+        return NO_START_BLOCK;
+    uint32_t currblock = entry->startblock;
+    uint32_t nextblock = file_nextblock(fs, entry, currblock);
+    while (nextblock != FAT_LIST_NULL)
+    {
+        currblock = nextblock;
+        nextblock = file_nextblock(fs, entry, currblock);
+        vsfs_count(fs, fathops, 1);
+    }
+    return currblock;
+}
+
+// number of physically consecutive blocks in the chain of entry starting
+// at blocknumber (blocknumber, blocknumber + 1, ...), at most limit
+uint32_t chain_run(struct vsfs *fs, directory_entry *entry, uint32_t blocknumber, uint32_t limit)
+{
+    uint32_t length = 1;
+    while (length < limit && file_nextblock(fs, entry, blocknumber + length - 1) == blocknumber + length)
+        length++;
+    vsfs_count(fs, fathops, length - 1);
+    return length;
+}
+
+/**********************************************************************
+  Readahead
+  a read that starts where the previous read of the descriptor ended is
+  sequential. every sequential read doubles the window, starting from
+  READAHEAD_MIN_BLOCKS up to READAHEAD_MAX_BLOCKS, and the blocks of the
+  window that were not read ahead yet are handed to the kernel in runs
+  of consecutive blocks, found by walking the FAT chain in memory. any
+  other read closes the window.
+***********************************************************************/
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 256
+
+// called after a read of the file, sequential tells whether it
+// continued the previous one
+void readahead_update(struct vsfs *fs, openfiletable_entry *openfile, bool sequential)
+{
+    openfile->readaheadnext = openfile->offset;
+    if (!sequential)
+    {
+        openfile->readaheadwindow = 0;
+        openfile->readaheadend = 0;
+        return;
+    }
+    if (openfile->readaheadwindow == 0)
+        openfile->readaheadwindow = READAHEAD_MIN_BLOCKS;
+    else if (openfile->readaheadwindow < READAHEAD_MAX_BLOCKS)
+        openfile->readaheadwindow *= 2;
+
+    // the cursor is in logical block first, physical block currblock
+    uintmax_t first = openfile->offset / fs->blocksize;
+    uintmax_t fileblocks = (openfile->entry->filesize + fs->blocksize - 1) / fs->blocksize;
+    uintmax_t end = first + openfile->readaheadwindow;
+    if (end > fileblocks)
+        end = fileblocks;
+    uintmax_t logical = first;
+    uint32_t block = openfile->currblock;
+    for (; logical < openfile->readaheadend && block != FAT_LIST_NULL; logical++)
+        block = file_nextblock(fs, openfile->entry, block);
+    uint32_t advised = 0;
+    while (logical < end && block != FAT_LIST_NULL)
+    {
+        uint32_t runlength = chain_run(fs, openfile->entry, block, end - logical);
+        dev_willneed(fs, block, runlength);
+        advised += runlength;
+        logical += runlength;
+        block = file_nextblock(fs, openfile->entry, block + runlength - 1);
+    }
+    if (logical > openfile->readaheadend)
+        openfile->readaheadend = logical;
+    pthread_mutex_lock(&fs->blockcache.lock);
+    fs->blockcache.stats.readaheads += advised;
+    pthread_mutex_unlock(&fs->blockcache.lock);
+}
+
+/**********************************************************************
+  Block index
+***********************************************************************/
+// fill in the block index of an open file from its FAT chain
+int blockindex_build(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    if (openfile->blockindex != NULL)
+        return 0;
+    uintmax_t count = (openfile->entry->filesize + fs->blocksize - 1) / fs->blocksize;
+    if (openfile->entry->flags & DIRENT_INLINE)
+        count = 0;
+    else if (openfile->entry->flags & DIRENT_PACKED)
+        count = openfile->entry->filesize / fs->blocksize; // the tail is not in the chain
+    uint32_t *index = (uint32_t *)malloc(sizeof(uint32_t) * (count == 0 ? 1 : count));
+    if (index == NULL)
+        return -1;
+    uint32_t block = openfile->entry->startblock;
+    for (uintmax_t i = 0; i < count; i++)
+    {
+        if (block == FAT_LIST_NULL)
         {
-            fflush(stdout);
-            // begin protocol with new block allocation
-            itervative_append(
-                get_nextfreeblock(),
-                lastallocatedblock,
-                n,
-                bytestream,
-                0);
-            openfiletable[fd].entry->filesize = currsize + n;
-            free(bytestream);
-            return 0;
+            vsfs_err("FAT chain of %s is shorter than the file\n", openfile->entry->filename);
+            free(index);
+            return -1;
         }
-        // outside has last block space if
+        index[i] = block;
+        block = file_nextblock(fs, openfile->entry, block);
     }
+    vsfs_count(fs, fathops, count);
+    openfile->blockindex = index;
+    openfile->blockindexcount = count;
+    return 0;
 }
 
-int vsdelete(char *filename)
+void blockindex_destroy(openfiletable_entry *openfile)
+{
+    free(openfile->blockindex);
+    openfile->blockindex = NULL;
+    openfile->blockindexcount = 0;
+}
+
+/**********************************************************************
+  Directory index
+  open addressing hash table from file name to directory slot, built on
+  mount and kept up to date by vscreate and vsdelete, plus a stack of
+  unoccupied slots. the table is kept at least twice the slot count and
+  grows with the directory.
+***********************************************************************/
+#define DIRINDEX_EMPTY -1
+#define DIRINDEX_DELETED -2
+
+directory_entry *dirent(struct vsfs *fs, int32_t slot)
+{
+    return &fs->directory.blocks[slot / DIRENTRIES_PER_BLOCK(fs)][slot % DIRENTRIES_PER_BLOCK(fs)];
+}
+
+static uint32_t dirindex_hash(const char *name)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++)
+    {
+        hash ^= (uint8_t)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// directory slot of the file called name, -1 if there is none
+int32_t dirindex_lookup(struct vsfs *fs, const char *name)
+{
+    uint32_t probe = dirindex_hash(name) & fs->dirindex.mask;
+    vsfs_count(fs, dirprobes, 1);
+    while (fs->dirindex.table[probe] != DIRINDEX_EMPTY)
+    {
+        int32_t slot = fs->dirindex.table[probe];
+        if (slot >= 0 && strcmp(dirent(fs, slot)->filename, name) == 0)
+            return slot;
+        probe = (probe + 1) & fs->dirindex.mask;
+        vsfs_count(fs, dirprobes, 1);
+    }
+    return -1;
+}
+
+static void dirindex_insert(struct vsfs *fs, const char *name, int32_t slot)
+{
+    uint32_t probe = dirindex_hash(name) & fs->dirindex.mask;
+    vsfs_count(fs, dirprobes, 1);
+    while (fs->dirindex.table[probe] >= 0)
+    {
+        probe = (probe + 1) & fs->dirindex.mask;
+        vsfs_count(fs, dirprobes, 1);
+    }
+    if (fs->dirindex.table[probe] == DIRINDEX_DELETED)
+        fs->dirindex.tombstones--;
+    fs->dirindex.table[probe] = slot;
+}
+
+static void dirindex_rehash(struct vsfs *fs)
+{
+    for (uint32_t i = 0; i <= fs->dirindex.mask; i++)
+        fs->dirindex.table[i] = DIRINDEX_EMPTY;
+    fs->dirindex.tombstones = 0;
+    for (int32_t slot = 0; slot < (int32_t)(fs->directory.count * DIRENTRIES_PER_BLOCK(fs)); slot++)
+    {
+        if (dirent(fs, slot)->isoccupied)
+            dirindex_insert(fs, dirent(fs, slot)->filename, slot);
+    }
+}
+
+static void dirindex_remove(struct vsfs *fs, const char *name)
 {
-    bool exists = false;
-    int blockidx = 0, offsetidx = 0;
-    for (int i = 0; i < 8; i++)
+    uint32_t probe = dirindex_hash(name) & fs->dirindex.mask;
+    vsfs_count(fs, dirprobes, 1);
+    while (fs->dirindex.table[probe] != DIRINDEX_EMPTY)
     {
-        for (int j = 0; j < 16; j++)
+        int32_t slot = fs->dirindex.table[probe];
+        if (slot >= 0 && strcmp(dirent(fs, slot)->filename, name) == 0)
         {
-            directory_entry *entry = &rootdir[i].entries[j];
-            if (strcmp(entry->filename, filename) == 0)
-            {
-                blockidx = i;
-                offsetidx = j;
-                exists = true;
-                break;
-            }
+            fs->dirindex.table[probe] = DIRINDEX_DELETED;
+            fs->dirindex.tombstones++;
+            return;
         }
+        probe = (probe + 1) & fs->dirindex.mask;
+        vsfs_count(fs, dirprobes, 1);
+    }
+}
+
+// drop tombstones once they make up a quarter of the table, so that
+// probe sequences stay short under create/delete churn. call it when
+// the directory entries are consistent with the index again.
+static void dirindex_compact(struct vsfs *fs)
+{
+    if (fs->dirindex.tombstones > (fs->dirindex.mask + 1) / 4)
+        dirindex_rehash(fs);
+}
+
+// size the table for the current directory and rehash, when needed
+static int dirindex_resize(struct vsfs *fs)
+{
+    uint32_t size = 256;
+    while (size < fs->directory.count * DIRENTRIES_PER_BLOCK(fs) * 2)
+        size <<= 1;
+    if (fs->dirindex.table != NULL && size == fs->dirindex.mask + 1)
+        return 0;
+    int32_t *table = (int32_t *)malloc(sizeof(int32_t) * size);
+    int32_t *freeslots = (int32_t *)realloc(fs->dirindex.freeslots, sizeof(int32_t) * size / 2);
+    if (table == NULL || freeslots == NULL)
+    {
+        free(table);
+        if (freeslots != NULL)
+            fs->dirindex.freeslots = freeslots;
+        return -1;
     }
-    if (!exists)
+    free(fs->dirindex.table);
+    fs->dirindex.table = table;
+    fs->dirindex.freeslots = freeslots;
+    fs->dirindex.mask = size - 1;
+    dirindex_rehash(fs);
+    return 0;
+}
+
+int dirindex_build(struct vsfs *fs)
+{
+    fs->dirindex.table = NULL;
+    fs->dirindex.freeslots = NULL;
+    if (dirindex_resize(fs) == -1)
         return -1;
+    fs->dirindex.freecount = 0;
+    for (int32_t slot = fs->directory.count * DIRENTRIES_PER_BLOCK(fs) - 1; slot >= 0; slot--)
+    {
+        if (!dirent(fs, slot)->isoccupied)
+            fs->dirindex.freeslots[fs->dirindex.freecount++] = slot;
+    }
+    return 0;
+}
 
-    uint16_t startblock = rootdir[blockidx].entries[offsetidx].startblock;
-    // delete file entry from rootdir
-    rootdir[blockidx].entries[offsetidx].filesize = 0;
-    for (int i = 0; i < 30; i++)
+void dirindex_destroy(struct vsfs *fs)
+{
+    free(fs->dirindex.table);
+    free(fs->dirindex.freeslots);
+    fs->dirindex.table = NULL;
+    fs->dirindex.freeslots = NULL;
+}
+
+/**********************************************************************
+  Directory blocks
+  the root directory has its own blocks in front of the data area. once
+  its slots run out, further directory blocks are allocated from the
+  data area and chained in the FAT, starting at geometry.dirextstart.
+  they are all read on mount.
+***********************************************************************/
+static int directory_addblock(struct vsfs *fs, directory_entry *block, uint32_t blocknumber)
+{
+    if (fs->directory.count == fs->directory.capacity)
+    {
+        uint32_t capacity = fs->directory.capacity == 0 ? 16 : fs->directory.capacity * 2;
+        directory_entry **blocks = (directory_entry **)realloc(fs->directory.blocks, sizeof(directory_entry *) * capacity);
+        if (blocks == NULL)
+            return -1;
+        fs->directory.blocks = blocks;
+        uint32_t *blocknumbers = (uint32_t *)realloc(fs->directory.blocknumbers, sizeof(uint32_t) * capacity);
+        if (blocknumbers == NULL)
+            return -1;
+        fs->directory.blocknumbers = blocknumbers;
+        bool *dirty = (bool *)realloc(fs->directory.dirty, sizeof(bool) * capacity);
+        if (dirty == NULL)
+            return -1;
+        fs->directory.dirty = dirty;
+        fs->directory.capacity = capacity;
+    }
+    if (fs->geometry.version == 1)
     {
-        rootdir[blockidx].entries[offsetidx].filename[i] = '\0';
+        for (uint32_t i = 0; i < DIRENTRIES_PER_BLOCK(fs); i++)
+            block[i].flags = 0;
     }
-    rootdir[blockidx].entries[offsetidx].isoccupied = false;
-    rootdir[blockidx].entries[offsetidx].startblock = NO_START_BLOCK;
+    fs->directory.blocks[fs->directory.count] = block;
+    fs->directory.blocknumbers[fs->directory.count] = blocknumber;
+    fs->directory.dirty[fs->directory.count] = false;
+    fs->directory.count++;
+    return 0;
+}
 
-    vsfs_info("vsdelete: file entry -> isoccupied: %d, filesize: %ld, startblock: %u, filename: %s\n",
-              rootdir[blockidx].entries[offsetidx].isoccupied,
-              rootdir[blockidx].entries[offsetidx].filesize,
-              rootdir[blockidx].entries[offsetidx].startblock,
-              rootdir[blockidx].entries[offsetidx].filename);
+void directory_destroy(struct vsfs *fs)
+{
+    for (uint32_t i = fs->geometry.rootdirblocks; i < fs->directory.count; i++)
+        free(fs->directory.blocks[i]);
+    free(fs->directory.blocks);
+    free(fs->directory.blocknumbers);
+    free(fs->directory.dirty);
+    memset(&fs->directory, 0, sizeof(fs->directory));
+}
 
-    data_block *emptyblock = new_datablock();
-    uint16_t currblock = startblock;
-    while (currblock != FAT_LIST_NULL)
+// collect the root blocks and read the directory blocks in the data area,
+// the FAT has to be loaded already
+int directory_load(struct vsfs *fs)
+{
+    memset(&fs->directory, 0, sizeof(fs->directory));
+    for (uint32_t i = 0; i < fs->geometry.rootdirblocks; i++)
     {
-        int status = write_block((void *)emptyblock, currblock);
-        if (status != 0)
+        if (directory_addblock(fs, fs->rootdir + i * DIRENTRIES_PER_BLOCK(fs), fs->geometry.rootdirstart + i) == -1)
+            return -1;
+    }
+    uint32_t blocknumber = fs->geometry.dirextstart;
+    for (uint32_t i = 0; i < fs->geometry.dirextcount && blocknumber != FAT_LIST_NULL; i++)
+    {
+        directory_entry *block = (directory_entry *)malloc(fs->blocksize);
+        if (block == NULL)
+            return -1;
+        if (dev_read_block(fs, (void *)block, blocknumber) == -1 ||
+            directory_addblock(fs, block, blocknumber) == -1)
         {
-            vsfs_err("failed to write empty block");
+            free(block);
             return -1;
         }
-        currblock = fattable[FAT_BLOCK(currblock)].entries[FAT_OFFSET(currblock)];
-        fattable[FAT_BLOCK(currblock)].entries[FAT_OFFSET(currblock)] = FAT_LIST_NULL;
+        blocknumber = fat_get(fs, blocknumber);
     }
+    return 0;
+}
 
-    vsfs_info("file deleted %s", filename);
-    print_fattable();
-    free(emptyblock);
+// add an empty directory block from the data area, its slots go on the
+// free slot stack
+int directory_grow(struct vsfs *fs)
+{
+    uint32_t lastblock = fs->directory.blocknumbers[fs->directory.count - 1];
+    uint32_t count;
+    bool extended = fs->directory.count > fs->geometry.rootdirblocks;
+    uint32_t blocknumber = get_freeextent(fs, 1, extended ? lastblock + 1 : 0, &count);
+    if (blocknumber == 0)
+        return -1;
+    cache_forget(fs, blocknumber);
+    directory_entry *block = (directory_entry *)calloc(1, fs->blocksize);
+    // a replayed journal reads the new block from disk, it has to be empty
+    bool written = block != NULL && (!fs->journal.active || dev_write_block(fs, (void *)block, blocknumber) == 0);
+    if (!written || directory_addblock(fs, block, blocknumber) == -1)
+    {
+        free(block);
+        release_block(fs, blocknumber);
+        return -1;
+    }
+    if (!extended)
+        fs->geometry.dirextstart = blocknumber;
+    else
+        fat_set(fs, lastblock, blocknumber);
+    fat_set(fs, blocknumber, FAT_LIST_NULL);
+    fs->geometry.dirextcount++;
+    mark_superblock_dirty(fs);
+    fs->directory.dirty[fs->directory.count - 1] = true;
+
+    if (dirindex_resize(fs) == -1)
+        return -1;
+    for (int32_t i = DIRENTRIES_PER_BLOCK(fs) - 1; i >= 0; i--)
+        fs->dirindex.freeslots[fs->dirindex.freecount++] = (fs->directory.count - 1) * DIRENTRIES_PER_BLOCK(fs) + i;
+    return 0;
+}
+
+// write the dirty directory blocks of the data area, consecutive blocks
+// with one pwritev
+int directory_flush(struct vsfs *fs)
+{
+    struct iovec iov[64];
+    uint32_t runstart = 0;
+    int runlength = 0;
+    for (uint32_t i = fs->geometry.rootdirblocks; i <= fs->directory.count; i++)
+    {
+        bool dirty = i < fs->directory.count && fs->directory.dirty[i];
+        if (runlength != 0 &&
+            (!dirty || runlength == 64 || fs->directory.blocknumbers[i] != runstart + runlength))
+        {
+            if (dev_transfer(fs, iov, runlength, runstart, true) == -1)
+                return -1;
+            runlength = 0;
+        }
+        if (!dirty)
+            continue;
+        if (runlength == 0)
+            runstart = fs->directory.blocknumbers[i];
+        iov[runlength].iov_base = (void *)fs->directory.blocks[i];
+        iov[runlength].iov_len = fs->blocksize;
+        runlength++;
+        fs->directory.dirty[i] = false;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/**********************************************************************
+  Utility Functions
+***********************************************************************/
+// #define PRINT_ROOTDIR
+#ifdef PRINT_ROOTDIR
+#define print_dir(func, ...) func(##__VA_ARGS__)
+#else
+#define print_dir(func) (void)0
+#endif
+void print_rootdir(struct vsfs *fs)
+{
+    for (uint32_t i = 0; i < fs->geometry.rootdirblocks; i++)
+    {
+        for (uint32_t j = 0; j < DIRENTRIES_PER_BLOCK(fs); j++)
+        {
+            directory_entry entry = fs->rootdir[i * DIRENTRIES_PER_BLOCK(fs) + j];
+            vsfs_info("formatted entry: isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
+                      entry.isoccupied, entry.startblock, entry.filesize, entry.filename);
+        }
+    }
+}
+
+// #define PRINT_FATTABLE
+#ifdef PRINT_FATTABLE
+#define print_table(func, ...) func(##__VA_ARGS__)
+#else
+#define print_table(func) (void)0
+#endif
+void print_fattable(struct vsfs *fs)
+{
+    for (uint32_t i = 0; i < fs->geometry.blockcount; i++)
+    {
+        vsfs_info("FAT entry of block %u is %u\n", i, fs->fattable[i]);
+    }
+}
+
+uint8_t *new_datablock(struct vsfs *fs)
+{
+    uint8_t *block = (uint8_t *)calloc(1, fs->blocksize);
+    return block;
+}
+
+// write the buffered tail block of an append descriptor to disk
+int flush_tail(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    if (!openfile->taildirty)
+        return 0;
+    if (write_block(fs, (void *)openfile->tailbuf, openfile->tailblock) == -1)
+        return -1;
+    openfile->taildirty = false;
+    return 0;
+}
+
+// lay out a v2 disk of count blocks of blocksize bytes: superblock,
+// bitmap, FAT, root directory, then the data blocks
+void geometry_compute(struct vsfs *fs, uint32_t count, uint32_t blocksize, uint32_t journalblocks)
+{
+    fs->blocksize = blocksize;
+    memset(&fs->geometry, 0, sizeof(fs->geometry));
+    fs->geometry.version = VSFS_VERSION;
+    fs->geometry.blockcount = count;
+    fs->geometry.bitmapstart = 1;
+    fs->geometry.bitmapblocks = (count + BITMAP_BITS_PER_BLOCK(fs) - 1) / BITMAP_BITS_PER_BLOCK(fs);
+    fs->geometry.fatstart = fs->geometry.bitmapstart + fs->geometry.bitmapblocks;
+    fs->geometry.fatblocks = (count + FAT_ENTRIES_PER_BLOCK(fs) - 1) / FAT_ENTRIES_PER_BLOCK(fs);
+    fs->geometry.rootdirstart = fs->geometry.fatstart + fs->geometry.fatblocks;
+    fs->geometry.rootdirblocks = (ROOTDIR_ENTRIES * sizeof(directory_entry) + blocksize - 1) / blocksize;
+    fs->geometry.journalstart = journalblocks == 0 ? 0 : fs->geometry.rootdirstart + fs->geometry.rootdirblocks;
+    fs->geometry.journalblocks = journalblocks;
+    fs->geometry.firstdatablock = fs->geometry.rootdirstart + fs->geometry.rootdirblocks + journalblocks;
+    fs->geometry.dirextstart = NO_START_BLOCK;
+    fs->geometry.dirextcount = 0;
+}
+
+static bool blocksize_valid(uint32_t blocksize)
+{
+    return blocksize >= VSFS_MIN_BLOCKSIZE && blocksize <= VSFS_MAX_BLOCKSIZE &&
+           (blocksize & (blocksize - 1)) == 0;
+}
+
+// take the geometry from the first BLOCKSIZE bytes of the disk, a v2
+// superblock or else a v1 one
+int geometry_load(struct vsfs *fs, void *block)
+{
+    super_block_v2 *sb = (super_block_v2 *)block;
+    memset(&fs->geometry, 0, sizeof(fs->geometry));
+    if (sb->v1blockcount == 0 && sb->v1blocksize == 0 && sb->magic == VSFS_MAGIC)
+    {
+        if (sb->version != VSFS_VERSION || !blocksize_valid(sb->blocksize))
+        {
+            vsfs_err("unsupported vdisk version %u or block size %u\n", sb->version, sb->blocksize);
+            return -1;
+        }
+        fs->blocksize = sb->blocksize;
+        fs->geometry.version = sb->version;
+        fs->geometry.blockcount = sb->blockcount;
+        fs->geometry.bitmapstart = sb->bitmapstart;
+        fs->geometry.bitmapblocks = sb->bitmapblocks;
+        fs->geometry.fatstart = sb->fatstart;
+        fs->geometry.fatblocks = sb->fatblocks;
+        fs->geometry.rootdirstart = sb->rootdirstart;
+        fs->geometry.rootdirblocks = sb->rootdirblocks;
+        fs->geometry.firstdatablock = sb->firstdatablock;
+        fs->geometry.dirextstart = sb->dirextstart;
+        fs->geometry.dirextcount = sb->dirextcount;
+        fs->geometry.journalstart = sb->journalstart;
+        fs->geometry.journalblocks = sb->journalblocks;
+        return 0;
+    }
+    memcpy(&fs->superblock, block, sizeof(super_block));
+    if (fs->superblock.blocksize != BLOCKSIZE || fs->superblock.blockcount <= 41)
+    {
+        vsfs_err("vdisk has no valid superblock\n");
+        return -1;
+    }
+    fs->blocksize = BLOCKSIZE;
+    fs->geometry.version = 1;
+    fs->geometry.blockcount = fs->superblock.blockcount;
+    fs->geometry.fatstart = 1;
+    fs->geometry.fatblocks = 32;
+    fs->geometry.rootdirstart = 33;
+    fs->geometry.rootdirblocks = 8;
+    fs->geometry.firstdatablock = 41;
+    fs->geometry.dirextstart = fs->superblock.dirextstart;
+    fs->geometry.dirextcount = fs->superblock.dirextcount;
+    return 0;
+}
+
+// fill the v2 superblock of the current geometry into block
+void superblock_image(struct vsfs *fs, void *block)
+{
+    memset(block, 0, fs->blocksize);
+    super_block_v2 *sb = (super_block_v2 *)block;
+    sb->magic = VSFS_MAGIC;
+    sb->version = fs->geometry.version;
+    sb->blocksize = fs->blocksize;
+    sb->blockcount = fs->geometry.blockcount;
+    sb->bitmapstart = fs->geometry.bitmapstart;
+    sb->bitmapblocks = fs->geometry.bitmapblocks;
+    sb->fatstart = fs->geometry.fatstart;
+    sb->fatblocks = fs->geometry.fatblocks;
+    sb->rootdirstart = fs->geometry.rootdirstart;
+    sb->rootdirblocks = fs->geometry.rootdirblocks;
+    sb->firstdatablock = fs->geometry.firstdatablock;
+    sb->dirextstart = fs->geometry.dirextstart;
+    sb->dirextcount = fs->geometry.dirextcount;
+    sb->journalstart = fs->geometry.journalstart;
+    sb->journalblocks = fs->geometry.journalblocks;
+}
+
+// contents of metadata block k as they go to disk. blocks that are kept
+// in memory in their on-disk format are returned in place, the others
+// are built in scratch, which holds one block.
+void *metadata_block(struct vsfs *fs, uint32_t k, void *scratch)
+{
+    if (k == 0)
+    {
+        if (fs->geometry.version != 1)
+        {
+            superblock_image(fs, scratch);
+            return scratch;
+        }
+        // v1: update the copy read on mount, so that the bit vector
+        // past the end of the disk stays as it was
+        fs->superblock.dirextstart = fs->geometry.dirextstart;
+        fs->superblock.dirextcount = fs->geometry.dirextcount;
+        for (uint32_t i = 0; i < MAX_BLOCK_COUNT && fs->geometry.firstdatablock + i < fs->geometry.blockcount; i++)
+        {
+            uint32_t b = fs->geometry.firstdatablock + i;
+            uint16_t mask = (uint16_t)(1u << (i % 16));
+            if (fs->allocator.freemap[b / 64] & (UINT64_C(1) << (b % 64)))
+                fs->superblock.freeblock_bitvector[i / 16] |= mask;
+            else
+                fs->superblock.freeblock_bitvector[i / 16] &= ~mask;
+        }
+        return (void *)&fs->superblock;
+    }
+    if (k >= fs->geometry.rootdirstart)
+        return (void *)(fs->rootdir + (size_t)(k - fs->geometry.rootdirstart) * DIRENTRIES_PER_BLOCK(fs));
+    if (k >= fs->geometry.fatstart)
+    {
+        uint32_t index = k - fs->geometry.fatstart;
+        if (fs->geometry.version != 1)
+            return (void *)(fs->fattable + (size_t)index * FAT_ENTRIES_PER_BLOCK(fs));
+        fat_table_block *block = (fat_table_block *)scratch;
+        memset(block, 0, sizeof(*block));
+        for (uint32_t offset = 0; offset <= FAT_OFFSET(UINT32_MAX); offset++)
+        {
+            uint32_t b = (index << 8) | offset;
+            if (b < fs->geometry.blockcount)
+                block->entries[offset] = fs->fattable[b];
+        }
+        return scratch;
+    }
+    // v2 bitmap: a bit set per used block
+    uint64_t *words = (uint64_t *)scratch;
+    size_t first = (size_t)(k - fs->geometry.bitmapstart) * (fs->blocksize / 8);
+    for (uint32_t w = 0; w < fs->blocksize / 8; w++)
+        words[w] = ~fs->allocator.freemap[first + w];
+    return scratch;
+}
+
+// write the dirty metadata blocks k that have wanted[k] set, or all of
+// them when wanted is NULL. adjacent blocks go out together in one pwritev
+static int metadata_writeback(struct vsfs *fs, const bool *wanted)
+{
+    struct iovec iov[BATCH_IOV_MAX];
+    uint8_t *scratch = (uint8_t *)malloc((size_t)fs->blocksize * BATCH_IOV_MAX);
+    if (scratch == NULL)
+        return -1;
+    uint32_t runstart = 0;
+    int runlength = 0;
+    for (uint32_t k = 0; k <= fs->geometry.firstdatablock; k++)
+    {
+        bool dirty = k < fs->geometry.firstdatablock && fs->metadata_dirty[k] && (wanted == NULL || wanted[k]);
+        if (runlength != 0 && (!dirty || runlength == BATCH_IOV_MAX))
+        {
+            if (dev_transfer(fs, iov, runlength, runstart, true) == -1)
+            {
+                free(scratch);
+                return -1;
+            }
+            for (uint32_t i = runstart; i < runstart + runlength; i++)
+                fs->metadata_dirty[i] = false;
+            runlength = 0;
+        }
+        if (!dirty)
+            continue;
+        if (runlength == 0)
+            runstart = k;
+        iov[runlength].iov_base = metadata_block(fs, k, (void *)(scratch + (size_t)runlength * fs->blocksize));
+        iov[runlength].iov_len = fs->blocksize;
+        runlength++;
+    }
+    free(scratch);
+    return 0;
+}
+
+// write only the metadata blocks changed since the last flush
+int flush_metadata(struct vsfs *fs)
+{
+    if (metadata_writeback(fs, NULL) == -1)
+        return -1;
+    return directory_flush(fs);
+}
+
+// write the dirty metadata blocks that describe the file in slot: the
+// superblock, its directory block and the FAT and bitmap blocks covering
+// its chain. the caller holds the whole mount.
+int flush_filemetadata(struct vsfs *fs, int32_t slot)
+{
+    directory_entry *entry = dirent(fs, slot);
+    bool *wanted = (bool *)calloc(fs->geometry.firstdatablock, sizeof(bool));
+    if (wanted == NULL)
+        return -1;
+    wanted[0] = true;
+    uint32_t dirblock = slot / DIRENTRIES_PER_BLOCK(fs);
+    if (dirblock < fs->geometry.rootdirblocks)
+        wanted[fs->geometry.rootdirstart + dirblock] = true;
+    for (uint32_t b = entry->startblock; b != FAT_LIST_NULL; b = file_nextblock(fs, entry, b))
+    {
+        wanted[fat_diskblock(fs, b)] = true;
+        if (fs->geometry.version != 1)
+            wanted[fs->geometry.bitmapstart + b / BITMAP_BITS_PER_BLOCK(fs)] = true;
+    }
+    int status = metadata_writeback(fs, wanted);
+    free(wanted);
+    if (status == 0 && dirblock >= fs->geometry.rootdirblocks && fs->directory.dirty[dirblock])
+    {
+        status = dev_write_block(fs, (void *)fs->directory.blocks[dirblock], fs->directory.blocknumbers[dirblock]);
+        if (status == 0)
+            fs->directory.dirty[dirblock] = false;
+    }
+    return status;
+}
+
+/**********************************************************************
+  Block reference counts
+  open addressed tables from block number to a count, for the blocks
+  several directory entries refer to.
+***********************************************************************/
+// slot of block in the table, or the empty slot it would take
+static uint32_t refcount_slot(refcount_table *table, uint32_t block)
+{
+    uint32_t probe = (block * 2654435761u) & table->mask;
+    while (table->blocks[probe] != 0 && table->blocks[probe] != block)
+        probe = (probe + 1) & table->mask;
+    return probe;
+}
+
+uint32_t refcount_get(refcount_table *table, uint32_t block)
+{
+    if (table->blocks == NULL)
+        return 0;
+    uint32_t slot = refcount_slot(table, block);
+    return table->blocks[slot] == block ? table->counts[slot] : 0;
+}
+
+// rehash into a table at most a quarter full, blocks counted down to 0
+// are left out
+static int refcount_grow(refcount_table *table)
+{
+    uint32_t live = 0;
+    for (uint32_t i = 0; table->blocks != NULL && i <= table->mask; i++)
+    {
+        if (table->blocks[i] != 0 && table->counts[i] != 0)
+            live++;
+    }
+    uint32_t size = 64;
+    while (size < (live + 1) * 4)
+        size *= 2;
+    refcount_table grown;
+    grown.blocks = (uint32_t *)calloc(size, sizeof(uint32_t));
+    grown.counts = (uint32_t *)calloc(size, sizeof(uint32_t));
+    if (grown.blocks == NULL || grown.counts == NULL)
+    {
+        free(grown.blocks);
+        free(grown.counts);
+        return -1;
+    }
+    grown.mask = size - 1;
+    grown.used = live;
+    for (uint32_t i = 0; table->blocks != NULL && i <= table->mask; i++)
+    {
+        if (table->blocks[i] == 0 || table->counts[i] == 0)
+            continue;
+        uint32_t slot = refcount_slot(&grown, table->blocks[i]);
+        grown.blocks[slot] = table->blocks[i];
+        grown.counts[slot] = table->counts[i];
+    }
+    free(table->blocks);
+    free(table->counts);
+    *table = grown;
+    return 0;
+}
+
+// add delta to the count of block and return the new count, -1 if the
+// block is not in the table yet and the table cannot grow
+int refcount_add(refcount_table *table, uint32_t block, int delta)
+{
+    uint32_t slot = 0;
+    if (table->blocks != NULL)
+        slot = refcount_slot(table, block);
+    if (table->blocks == NULL || table->blocks[slot] != block)
+    {
+        if ((table->blocks == NULL || (table->used + 1) * 2 > table->mask + 1) && refcount_grow(table) == -1)
+            return -1;
+        slot = refcount_slot(table, block);
+        table->blocks[slot] = block;
+        table->counts[slot] = 0;
+        table->used++;
+    }
+    table->counts[slot] += delta;
+    return table->counts[slot];
+}
+
+void refcount_destroy(refcount_table *table)
+{
+    free(table->blocks);
+    free(table->counts);
+    table->blocks = NULL;
+    table->counts = NULL;
+    table->mask = 0;
+    table->used = 0;
+}
+
+/**********************************************************************
+  Shared blocks
+  vsclone gives the new file the chain of the old one. both entries get
+  DIRENT_SHARED and fs->shares counts the files holding each block of
+  the chain, a count of 0 or 1 means a single owner and the block is
+  treated like any other. the FAT entry of a block held by several files
+  never changes: an append into a shared partial last block copies it
+  into a block of its own first, and a file whose chain has to go on
+  after a shared block records that in its entry as a fork (forkblock,
+  forknext). there is room for one fork per entry, a file that needs a
+  second one gets a private copy of its chain. the counts are rebuilt
+  from the chains of the shared entries on mount.
+  a clone reads and writes no block, but it does count every block of
+  the chain, so it takes time linear in the file size. a single count
+  for the whole chain would not survive the first fork or copy, after
+  which delete and append need to know per block who else holds it.
+***********************************************************************/
+// whether other files hold block as well
+static bool block_shared(struct vsfs *fs, uint32_t block)
+{
+    pthread_mutex_lock(&fs->sharelock);
+    bool shared = refcount_get(&fs->shares, block) > 1;
+    pthread_mutex_unlock(&fs->sharelock);
+    return shared;
+}
+
+// one more file holds block, the first clone of a block makes two
+static int share_add(struct vsfs *fs, uint32_t block)
+{
+    pthread_mutex_lock(&fs->sharelock);
+    int count = refcount_add(&fs->shares, block, refcount_get(&fs->shares, block) == 0 ? 2 : 1);
+    pthread_mutex_unlock(&fs->sharelock);
+    return count == -1 ? -1 : 0;
+}
+
+// a file lets go of block. returns whether other files still hold it,
+// if not the caller is its only owner.
+static bool share_drop(struct vsfs *fs, uint32_t block)
+{
+    pthread_mutex_lock(&fs->sharelock);
+    uint32_t count = refcount_get(&fs->shares, block);
+    if (count != 0)
+        refcount_add(&fs->shares, block, -1);
+    pthread_mutex_unlock(&fs->sharelock);
+    return count > 1;
+}
+
+// count the shared entries holding each block of their chains
+int share_load(struct vsfs *fs)
+{
+    for (int32_t slot = 0; slot < (int32_t)(fs->directory.count * DIRENTRIES_PER_BLOCK(fs)); slot++)
+    {
+        directory_entry *entry = dirent(fs, slot);
+        if (!entry->isoccupied || !(entry->flags & DIRENT_SHARED))
+            continue;
+        for (uint32_t b = entry->startblock; b != FAT_LIST_NULL; b = file_nextblock(fs, entry, b))
+        {
+            if (refcount_add(&fs->shares, b, 1) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// make block follow prevblock (NO_START_BLOCK for none) in the chain of
+// the file in slot. after a shared block the file forks off the chain,
+// -1 if it has forked already.
+int file_link(struct vsfs *fs, int32_t slot, uint32_t prevblock, uint32_t block)
+{
+    directory_entry *entry = dirent(fs, slot);
+    if (prevblock == NO_START_BLOCK)
+        entry->startblock = block;
+    else if ((entry->flags & DIRENT_FORKED) && prevblock == entry->forkblock)
+        entry->forknext = block;
+    else if (!(entry->flags & DIRENT_SHARED) || !block_shared(fs, prevblock))
+    {
+        fat_set(fs, prevblock, block);
+        return 0;
+    }
+    else if (entry->flags & DIRENT_FORKED)
+        return -1;
+    else
+    {
+        entry->flags |= DIRENT_FORKED;
+        entry->forkblock = prevblock;
+        entry->forknext = block;
+    }
+    mark_dirslot_dirty(fs, slot);
+    return 0;
+}
+
+// give the file of openfile a copy of its own of every shared block of
+// its chain, it needs no fork after that
+int file_unshare(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    directory_entry *entry = openfile->entry;
+    uint32_t count = 0;
+    for (uint32_t b = entry->startblock; b != FAT_LIST_NULL; b = file_nextblock(fs, entry, b))
+        count++;
+    uint32_t *chain = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t *copies = (uint32_t *)malloc(sizeof(uint32_t) * (count + 1));
+    uint8_t *block = new_datablock(fs);
+    if (chain == NULL || copies == NULL || block == NULL)
+    {
+        free(chain);
+        free(copies);
+        free(block);
+        return -1;
+    }
+    count = 0;
+    for (uint32_t b = entry->startblock; b != FAT_LIST_NULL; b = file_nextblock(fs, entry, b))
+        chain[count++] = b;
+    vsfs_count(fs, fathops, count);
+
+    // copy first, the chain stays as it is until all copies are made
+    uint32_t copied = 0;
+    for (; copied < count; copied++)
+    {
+        copies[copied] = chain[copied];
+        if (!block_shared(fs, chain[copied]))
+            continue;
+        uint32_t runlength;
+        uint32_t copy = get_freeextent(fs, 1, copied == 0 ? 0 : copies[copied - 1] + 1, &runlength);
+        if (copy == 0)
+        {
+            vsfs_err("no free block left to unshare %s\n", entry->filename);
+            break;
+        }
+        if (read_block(fs, (void *)block, chain[copied]) == -1 || write_block(fs, (void *)block, copy) == -1)
+        {
+            release_block(fs, copy);
+            break;
+        }
+        copies[copied] = copy;
+    }
+    free(block);
+    if (copied < count)
+    {
+        for (uint32_t i = 0; i < copied; i++)
+        {
+            if (copies[i] != chain[i])
+                release_block(fs, copies[i]);
+        }
+        free(chain);
+        free(copies);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t next = i + 1 < count ? copies[i + 1] : FAT_LIST_NULL;
+        if (fat_get(fs, copies[i]) != next)
+            fat_set(fs, copies[i], next);
+        // the other owners may have let go since it was copied
+        if (copies[i] != chain[i] && !share_drop(fs, chain[i]))
+            release_block(fs, chain[i]);
+    }
+    if (count > 0)
+        entry->startblock = copies[0];
+    if (openfile->tailbuf != NULL && count > 0)
+        openfile->tailblock = copies[count - 1];
+    entry->flags &= ~(DIRENT_SHARED | DIRENT_FORKED);
+    entry->forkblock = 0;
+    entry->forknext = 0;
+    mark_dirslot_dirty(fs, openfile->slot);
+    free(chain);
+    free(copies);
+    return 0;
+}
+
+// before an append to a shared file. a shared partial last block is
+// copied into a block of its own, which becomes the tail buffer, and a
+// file that could not link its next block gets a private chain.
+int append_prepare(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    directory_entry *entry = openfile->entry;
+    uint32_t lastblock = openfile->tailbuf != NULL ? openfile->tailblock : get_lastallocatedblock(fs, entry);
+    if (lastblock == NO_START_BLOCK || !block_shared(fs, lastblock))
+        return 0;
+    bool forked = (entry->flags & DIRENT_FORKED) != 0;
+    if (entry->filesize % fs->blocksize == 0 || (entry->flags & DIRENT_PACKED))
+    {
+        // the next block goes right after the shared last block
+        if (forked && entry->forkblock != lastblock)
+            return file_unshare(fs, openfile);
+        return 0;
+    }
+
+    uint32_t prevblock = NO_START_BLOCK;
+    for (uint32_t b = entry->startblock; b != lastblock; b = file_nextblock(fs, entry, b))
+    {
+        prevblock = b;
+        vsfs_count(fs, fathops, 1);
+    }
+    if (prevblock != NO_START_BLOCK && forked && prevblock != entry->forkblock && block_shared(fs, prevblock))
+        return file_unshare(fs, openfile);
+    if (openfile->tailbuf == NULL)
+    {
+        openfile->tailbuf = new_datablock(fs);
+        if (openfile->tailbuf == NULL)
+            return -1;
+        openfile->tailblock = lastblock;
+        openfile->taildirty = false;
+        if (read_block(fs, (void *)openfile->tailbuf, lastblock) == -1)
+        {
+            free(openfile->tailbuf);
+            openfile->tailbuf = NULL;
+            return -1;
+        }
+    }
+    uint32_t runlength;
+    uint32_t newblock = get_freeextent(fs, 1, lastblock + 1, &runlength);
+    if (newblock == 0)
+    {
+        vsfs_err("no free block left for append\n");
+        return -1;
+    }
+    fat_set(fs, newblock, FAT_LIST_NULL);
+    if (file_link(fs, openfile->slot, prevblock, newblock) == -1)
+    {
+        release_block(fs, newblock);
+        return -1;
+    }
+    if (!share_drop(fs, lastblock))
+        release_block(fs, lastblock);
+    openfile->tailblock = newblock;
+    openfile->taildirty = true;
+    return 0;
+}
+
+/**********************************************************************
+  Tail packing
+  when an append descriptor of a v2 disk is closed, a last partial block
+  of at most PACK_TAIL_MAX bytes moves into a pack block that holds the
+  tails of other files as well, and its own block is given back. the
+  directory entry then has DIRENT_PACKED set and finds the tail at
+  tailoffset in packblock, the FAT chain holds the whole blocks only.
+  new tails go after the last one in the current pack block, space is
+  not reused until a pack block is given back, which happens once no
+  entry refers to it anymore. the number of entries referring to each
+  pack block is counted on mount. the next append to a packed file moves
+  its tail back into a block of its own.
+***********************************************************************/
+#define PACK_TAIL_MAX(fs) ((fs)->blocksize / 2)
+
+// count the entries referring to each pack block
+int tailpack_load(struct vsfs *fs)
+{
+    fs->pack.block = NO_START_BLOCK;
+    for (int32_t slot = 0; slot < (int32_t)(fs->directory.count * DIRENTRIES_PER_BLOCK(fs)); slot++)
+    {
+        directory_entry *entry = dirent(fs, slot);
+        if (entry->isoccupied && (entry->flags & DIRENT_PACKED) &&
+            refcount_add(&fs->pack.tails, entry->packblock, 1) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+void tailpack_destroy(struct vsfs *fs)
+{
+    free(fs->pack.buf);
+    fs->pack.buf = NULL;
+    refcount_destroy(&fs->pack.tails);
+}
+
+// an entry stopped referring to pack block, give the block back if it
+// was the last one. pack.lock is held.
+static void tailpack_drop(struct vsfs *fs, uint32_t block)
+{
+    if (refcount_add(&fs->pack.tails, block, -1) > 0)
+        return;
+    if (block == fs->pack.block)
+    {
+        fs->pack.block = NO_START_BLOCK;
+        fs->pack.used = 0;
+    }
+    release_block(fs, block);
+}
+
+// put length bytes of tail into the current pack block, starting a new
+// one when they do not fit. returns 0 and where they went, -1 if they
+// stay where they are.
+static int tailpack_store(struct vsfs *fs, uint8_t *tail, uint32_t length, uint32_t *block, uint32_t *offset)
+{
+    if (fs->pack.buf == NULL && (fs->pack.buf = new_datablock(fs)) == NULL)
+        return -1;
+    if (fs->pack.block == NO_START_BLOCK || fs->pack.used + length > fs->blocksize)
+    {
+        uint32_t newblock = get_nextfreeblock(fs);
+        if (newblock == 0)
+            return -1;
+        fat_set(fs, newblock, FAT_LIST_NULL);
+        fs->pack.block = newblock;
+        fs->pack.used = 0;
+        memset(fs->pack.buf, 0, fs->blocksize);
+    }
+    if (refcount_add(&fs->pack.tails, fs->pack.block, 1) == -1)
+    {
+        if (fs->pack.used == 0)
+        {
+            release_block(fs, fs->pack.block);
+            fs->pack.block = NO_START_BLOCK;
+        }
+        return -1;
+    }
+    memcpy(fs->pack.buf + fs->pack.used, tail, length);
+    if (write_block(fs, (void *)fs->pack.buf, fs->pack.block) == -1)
+    {
+        tailpack_drop(fs, fs->pack.block);
+        return -1;
+    }
+    *block = fs->pack.block;
+    *offset = fs->pack.used;
+    fs->pack.used += length;
+    return 0;
+}
+
+// move the buffered tail of an append descriptor into a pack block.
+// returns 1 when it moved, 0 when it keeps its block.
+int tail_pack(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    directory_entry *entry = openfile->entry;
+    uint32_t length = entry->filesize % fs->blocksize;
+    if (fs->geometry.version == 1 || openfile->tailbuf == NULL || length == 0 ||
+        length > PACK_TAIL_MAX(fs) || (entry->flags & (DIRENT_INLINE | DIRENT_PACKED | DIRENT_SHARED)))
+        return 0;
+    uint32_t packblock, tailoffset;
+    pthread_mutex_lock(&fs->pack.lock);
+    int status = tailpack_store(fs, openfile->tailbuf, length, &packblock, &tailoffset);
+    pthread_mutex_unlock(&fs->pack.lock);
+    if (status == -1)
+        return 0;
+
+    // unlink the tail block, it is the last one of the chain
+    if (entry->startblock == openfile->tailblock)
+        entry->startblock = NO_START_BLOCK;
+    else
+    {
+        uint32_t prevblock = entry->startblock;
+        while (fat_get(fs, prevblock) != openfile->tailblock)
+        {
+            prevblock = fat_get(fs, prevblock);
+            vsfs_count(fs, fathops, 1);
+        }
+        fat_set(fs, prevblock, FAT_LIST_NULL);
+    }
+    release_block(fs, openfile->tailblock);
+    entry->flags |= DIRENT_PACKED;
+    entry->packblock = packblock;
+    entry->tailoffset = tailoffset;
+    mark_dirslot_dirty(fs, openfile->slot);
+    openfile->tailblock = NO_START_BLOCK;
+    openfile->taildirty = false;
+    return 1;
+}
+
+// move the tail of a packed file back into a block of its own, which
+// becomes the tail buffer of the append descriptor
+int tail_unpack(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    directory_entry *entry = openfile->entry;
+    uint32_t length = entry->filesize % fs->blocksize;
+    uint8_t *block = new_datablock(fs);
+    if (block == NULL)
+        return -1;
+    if (read_block(fs, (void *)block, entry->packblock) == -1)
+    {
+        free(block);
+        return -1;
+    }
+    memmove(block, block + entry->tailoffset, length);
+    memset(block + length, 0, fs->blocksize - length);
+    uint32_t lastblock = get_lastallocatedblock(fs, entry);
+    uint32_t runlength;
+    uint32_t newblock = get_freeextent(fs, 1, lastblock + 1, &runlength);
+    if (newblock == 0)
+    {
+        vsfs_err("no free block left for append\n");
+        free(block);
+        return -1;
+    }
+    fat_set(fs, newblock, FAT_LIST_NULL);
+    if (file_link(fs, openfile->slot, lastblock, newblock) == -1)
+    {
+        release_block(fs, newblock);
+        free(block);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fs->pack.lock);
+    tailpack_drop(fs, entry->packblock);
+    pthread_mutex_unlock(&fs->pack.lock);
+    entry->flags &= ~DIRENT_PACKED;
+    entry->packblock = 0;
+    entry->tailoffset = 0;
+    mark_dirslot_dirty(fs, openfile->slot);
+
+    free(openfile->tailbuf);
+    openfile->tailbuf = block;
+    openfile->tailblock = newblock;
+    openfile->taildirty = true;
+    return 0;
+}
+
+/**********************************************************************
+  Metadata journal
+  disks formatted with VSFS_FORMAT_JOURNAL keep a write-ahead log of
+  metadata changes in front of the data area. the operations that change
+  metadata note the FAT entries, free map words and directory slots they
+  touch. when one of them finishes it commits: the current values of
+  everything noted since the last commit go into the journal as one
+  transaction, followed by one fdatasync. operations that finish while a
+  commit is being written wait and go together in the next one, so the
+  sync is shared by everything that finished in the meantime.
+  when the journal fills up, and on vssync/vsumount, the metadata is
+  written to its home blocks instead and the journal starts over under
+  a new generation. vsmount replays the transactions of the current
+  generation, which are recognized by their sequence and checksum.
+***********************************************************************/
+#define JOURNAL_BYTES (256 * 1024) // journal size at format time
+#define JOURNAL_MAGIC 0x4c4e524a   // "JRNL"
+
+enum journal_record_type
+{
+    JOURNAL_FAT = 1,    // key: block number, value: its FAT entry
+    JOURNAL_BITMAP = 2, // key: free map word, value: the word
+    JOURNAL_DIRENT = 3, // key: directory slot, followed by the entry
+    JOURNAL_DIREXT = 4, // key: dirextstart, value: dirextcount
+};
+
+typedef struct journal_record
+{
+    uint32_t type;
+    uint32_t key;
+    uint64_t value;
+} journal_record;
+
+// block 0 of the journal has the generation, every transaction starts
+// on a block of its own with this header followed by its records
+typedef struct journal_header
+{
+    uint32_t magic;
+    uint32_t generation;
+    uint32_t sequence; // 0 for the first transaction of a generation
+    uint32_t blocks;   // including the one holding the header
+    uint32_t bytes;    // of records
+    uint32_t checksum; // of the header, with checksum 0, and the records
+} journal_header;
+
+static uint32_t journal_checksum(uint32_t hash, const uint8_t *bytes, size_t length)
+{
+    // FNV-1a
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t journal_txnchecksum(journal_header *header)
+{
+    uint32_t checksum = header->checksum;
+    header->checksum = 0;
+    uint32_t hash = journal_checksum(2166136261u, (const uint8_t *)header, sizeof(journal_header) + header->bytes);
+    header->checksum = checksum;
+    return hash;
+}
+
+// push what was written to the vdisk to stable storage
+int dev_sync(struct vsfs *fs)
+{
+    vsfs_count(fs, synccalls, 1);
+    if (fs->map != NULL)
+    {
+        if (msync(fs->map, fs->mapsize, MS_SYNC) != 0)
+        {
+            vsfs_err("failed to sync vdisk mapping\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (fdatasync(fs->fd) != 0)
+    {
+        vsfs_err("failed to sync vdisk\n");
+        return -1;
+    }
+    return 0;
+}
+
+// push the blocks of the chain of entry starting at startblock to stable
+// storage. only a mapping can be synced by range, fdatasync takes all
+// of the vdisk.
+static int dev_syncchain(struct vsfs *fs, directory_entry *entry, uint32_t startblock)
+{
+    if (fs->map == NULL)
+        return dev_sync(fs);
+    off_t pagemask = ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    uint32_t b = startblock;
+    while (b != FAT_LIST_NULL)
+    {
+        uint32_t runlength = chain_run(fs, entry, b, UINT32_MAX);
+        off_t offset = (off_t)b * fs->blocksize;
+        off_t pagestart = offset & pagemask;
+        vsfs_count(fs, synccalls, 1);
+        if (msync(fs->map + pagestart, (size_t)runlength * fs->blocksize + (offset - pagestart), MS_SYNC) != 0)
+        {
+            vsfs_err("failed to sync vdisk mapping\n");
+            return -1;
+        }
+        b = file_nextblock(fs, entry, b + runlength - 1);
+    }
+    return 0;
+}
+
+// write back every dirty metadata and cached block and sync the vdisk
+static int sync_home(struct vsfs *fs)
+{
+    int status = flush_metadata(fs);
+    if (status == -1)
+        return -1;
+    pthread_mutex_lock(&fs->blockcache.lock);
+    status = cache_flush(fs);
+    pthread_mutex_unlock(&fs->blockcache.lock);
+    if (status == -1)
+        return -1;
+    if (fs->map != NULL)
+        return dev_sync(fs); // the mapping is the only copy we wrote to
+    vsfs_count(fs, synccalls, 1);
+    fsync(fs->fd); // synchronize kernel file cache with the disk
+    return 0;
+}
+
+// forget what was noted, the caller holds journal.lock
+static void journal_clearkeys(struct vsfs *fs)
+{
+    fs->journal.fat.count = 0;
+    fs->journal.bitmap.count = 0;
+    fs->journal.dirslots.count = 0;
+    fs->journal.direxttouched = false;
+    fs->journal.overflow = false;
+}
+
+// read the transactions of the current generation into *records, the
+// records of all of them one after the other, and find the journal head
+static int journal_read(struct vsfs *fs, uint8_t **records, size_t *length)
+{
+    size_t regionsize = (size_t)fs->geometry.journalblocks * fs->blocksize;
+    uint8_t *region = (uint8_t *)malloc(regionsize);
+    *records = (uint8_t *)malloc(regionsize);
+    *length = 0;
+    if (region == NULL || *records == NULL)
+    {
+        free(region);
+        return -1;
+    }
+    struct iovec iov = {(void *)region, regionsize};
+    if (dev_transfer(fs, &iov, 1, fs->geometry.journalstart, false) == -1)
+    {
+        free(region);
+        return -1;
+    }
+    journal_header *first = (journal_header *)region;
+    fs->journal.generation = first->magic == JOURNAL_MAGIC ? first->generation : 0;
+    fs->journal.sequence = 0;
+    fs->journal.head = 1;
+    while (fs->journal.head < fs->geometry.journalblocks)
+    {
+        journal_header *header = (journal_header *)(region + (size_t)fs->journal.head * fs->blocksize);
+        if (header->magic != JOURNAL_MAGIC || header->generation != fs->journal.generation ||
+            header->sequence != fs->journal.sequence || header->blocks == 0 ||
+            header->blocks > fs->geometry.journalblocks - fs->journal.head ||
+            header->bytes > (size_t)header->blocks * fs->blocksize - sizeof(journal_header) ||
+            header->checksum != journal_txnchecksum(header))
+            break; // end of the log, or a torn write
+        memcpy(*records + *length, header + 1, header->bytes);
+        *length += header->bytes;
+        fs->journal.head += header->blocks;
+        fs->journal.sequence++;
+    }
+    free(region);
+    return 0;
+}
+
+// apply the records read by journal_read to the metadata in memory. the
+// directory entries go in a second pass, once the directory is loaded.
+static void journal_apply(struct vsfs *fs, uint8_t *records, size_t length, bool dirents)
+{
+    size_t position = 0;
+    while (position + sizeof(journal_record) <= length)
+    {
+        journal_record *record = (journal_record *)(records + position);
+        position += sizeof(journal_record);
+        if (record->type == JOURNAL_DIRENT)
+        {
+            position += sizeof(directory_entry);
+            if (dirents && record->key < fs->directory.count * DIRENTRIES_PER_BLOCK(fs))
+            {
+                memcpy(dirent(fs, record->key), record + 1, sizeof(directory_entry));
+                mark_dirslot_dirty(fs, record->key);
+            }
+            continue;
+        }
+        if (dirents)
+            continue;
+        if (record->type == JOURNAL_FAT && record->key < fs->geometry.blockcount)
+        {
+            fs->fattable[record->key] = (uint32_t)record->value;
+            fs->metadata_dirty[fat_diskblock(fs, record->key)] = true;
+        }
+        else if (record->type == JOURNAL_BITMAP && record->key < fs->allocator.words)
+        {
+            fs->allocator.freemap[record->key] = record->value;
+            fs->metadata_dirty[fs->geometry.bitmapstart + record->key / (fs->blocksize / 8)] = true;
+        }
+        else if (record->type == JOURNAL_DIREXT)
+        {
+            fs->geometry.dirextstart = record->key;
+            fs->geometry.dirextcount = (uint32_t)record->value;
+            fs->metadata_dirty[0] = true;
+        }
+    }
+    if (!dirents)
+    {
+        fs->allocator.freecount = 0;
+        for (uint32_t w = 0; w < fs->allocator.words; w++)
+            fs->allocator.freecount += __builtin_popcountll(fs->allocator.freemap[w]);
+    }
+}
+
+// start the journal over under the next generation
+static int journal_reset(struct vsfs *fs)
+{
+    uint8_t *block = (uint8_t *)calloc(1, fs->blocksize);
+    if (block == NULL)
+        return -1;
+    journal_header *header = (journal_header *)block;
+    header->magic = JOURNAL_MAGIC;
+    header->generation = fs->journal.generation + 1;
+    int status = dev_write_block(fs, (void *)block, fs->geometry.journalstart);
+    free(block);
+    if (status == 0)
+        status = dev_sync(fs);
+    if (status == -1)
+        return -1;
+    fs->journal.generation++;
+    fs->journal.sequence = 0;
+    fs->journal.head = 1;
+    return 0;
+}
+
+// write the metadata home and empty the journal. the caller commits
+// and holds the operation lock exclusively.
+static int journal_checkpointheld(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->journal.lock);
+    journal_clearkeys(fs);
+    pthread_mutex_unlock(&fs->journal.lock);
+    int status = sync_home(fs);
+    if (status == 0)
+        status = journal_reset(fs);
+    return status;
+}
+
+// size of the records for what was noted, the caller holds journal.lock
+static size_t journal_recordbytes(struct vsfs *fs)
+{
+    size_t count = fs->journal.fat.count + fs->journal.bitmap.count + fs->journal.dirslots.count;
+    if (fs->journal.direxttouched)
+        count++;
+    return count * sizeof(journal_record) + (size_t)fs->journal.dirslots.count * sizeof(directory_entry);
+}
+
+// build the transaction for what was noted, the caller holds journal.lock
+static void journal_build(struct vsfs *fs, journal_header *header, size_t bytes, uint32_t blocks)
+{
+    header->magic = JOURNAL_MAGIC;
+    header->generation = fs->journal.generation;
+    header->sequence = fs->journal.sequence;
+    header->blocks = blocks;
+    header->bytes = bytes;
+    journal_record *record = (journal_record *)(header + 1);
+    for (uint32_t i = 0; i < fs->journal.fat.count; i++, record++)
+    {
+        record->type = JOURNAL_FAT;
+        record->key = fs->journal.fat.keys[i];
+        record->value = fs->fattable[record->key];
+    }
+    for (uint32_t i = 0; i < fs->journal.bitmap.count; i++, record++)
+    {
+        record->type = JOURNAL_BITMAP;
+        record->key = fs->journal.bitmap.keys[i];
+        record->value = fs->allocator.freemap[record->key];
+    }
+    if (fs->journal.direxttouched)
+    {
+        record->type = JOURNAL_DIREXT;
+        record->key = fs->geometry.dirextstart;
+        record->value = fs->geometry.dirextcount;
+        record++;
+    }
+    for (uint32_t i = 0; i < fs->journal.dirslots.count; i++)
+    {
+        record->type = JOURNAL_DIRENT;
+        record->key = fs->journal.dirslots.keys[i];
+        record->value = 0;
+        memcpy(record + 1, dirent(fs, record->key), sizeof(directory_entry));
+        record = (journal_record *)((uint8_t *)(record + 1) + sizeof(directory_entry));
+    }
+    header->checksum = journal_txnchecksum(header);
+}
+
+// write one transaction with everything finished so far, *covered is
+// the ticket of the last operation in it. the caller commits.
+static int journal_write(struct vsfs *fs, uint64_t *covered)
+{
+    pthread_rwlock_wrlock(&fs->journal.oplock);
+    // data the operations left in the cache goes out first
+    pthread_mutex_lock(&fs->blockcache.lock);
+    int status = cache_flush(fs);
+    pthread_mutex_unlock(&fs->blockcache.lock);
+
+    pthread_mutex_lock(&fs->journal.lock);
+    *covered = fs->journal.ticket;
+    size_t bytes = journal_recordbytes(fs);
+    uint32_t blocks = (sizeof(journal_header) + bytes + fs->blocksize - 1) / fs->blocksize;
+    bool fits = !fs->journal.overflow && blocks <= fs->geometry.journalblocks - fs->journal.head;
+    uint8_t *transaction = NULL;
+    if (status == 0 && fits && bytes != 0)
+    {
+        transaction = (uint8_t *)calloc(blocks, fs->blocksize);
+        if (transaction == NULL)
+            status = -1;
+        else
+        {
+            journal_build(fs, (journal_header *)transaction, bytes, blocks);
+            journal_clearkeys(fs);
+        }
+    }
+    pthread_mutex_unlock(&fs->journal.lock);
+    if (status == 0 && !fits)
+        status = journal_checkpointheld(fs);
+    pthread_rwlock_unlock(&fs->journal.oplock);
+    if (transaction == NULL)
+        return status;
+
+    // the data the transaction covers has to be stable before the
+    // transaction is, or a replay could commit a size over blocks that
+    // never made it to disk
+    status = dev_sync(fs);
+    struct iovec iov = {(void *)transaction, (size_t)blocks * fs->blocksize};
+    if (status == 0)
+        status = dev_transfer(fs, &iov, 1, fs->geometry.journalstart + fs->journal.head, true);
+    free(transaction);
+    if (status == 0)
+        status = dev_sync(fs);
+    if (status == -1)
+    {
+        // the changes in it are only in memory now, write them home next
+        pthread_mutex_lock(&fs->journal.lock);
+        fs->journal.overflow = true;
+        pthread_mutex_unlock(&fs->journal.lock);
+        return -1;
+    }
+    fs->journal.head += blocks;
+    fs->journal.sequence++;
+    return 0;
+}
+
+// operations that change metadata run between journal_begin and
+// journal_end, commits never see them half done
+static void journal_begin(struct vsfs *fs)
+{
+    if (fs->journal.active)
+        pthread_rwlock_rdlock(&fs->journal.oplock);
+}
+
+static void journal_end(struct vsfs *fs)
+{
+    if (fs->journal.active)
+        pthread_rwlock_unlock(&fs->journal.oplock);
+}
+
+// make the operation that just finished durable, after journal_end and
+// with no other lock held. returns once a commit covering it is synced.
+static int journal_commit(struct vsfs *fs)
+{
+    if (!fs->journal.active)
+        return 0;
+    int status = 0;
+    pthread_mutex_lock(&fs->journal.lock);
+    uint64_t ticket = ++fs->journal.ticket;
+    while (fs->journal.durable < ticket && status == 0)
+    {
+        if (fs->journal.committing)
+        {
+            pthread_cond_wait(&fs->journal.committed, &fs->journal.lock);
+            continue;
+        }
+        fs->journal.committing = true;
+        pthread_mutex_unlock(&fs->journal.lock);
+        uint64_t covered;
+        status = journal_write(fs, &covered);
+        pthread_mutex_lock(&fs->journal.lock);
+        fs->journal.committing = false;
+        if (status == 0 && covered > fs->journal.durable)
+            fs->journal.durable = covered;
+        pthread_cond_broadcast(&fs->journal.committed);
+    }
+    pthread_mutex_unlock(&fs->journal.lock);
+    return status;
+}
+
+// write the metadata home and empty the journal, waits for a commit
+// that is being written
+static int journal_checkpoint(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->journal.lock);
+    while (fs->journal.committing)
+        pthread_cond_wait(&fs->journal.committed, &fs->journal.lock);
+    fs->journal.committing = true;
+    uint64_t covered = fs->journal.ticket;
+    pthread_mutex_unlock(&fs->journal.lock);
+
+    pthread_rwlock_wrlock(&fs->journal.oplock);
+    int status = journal_checkpointheld(fs);
+    pthread_rwlock_unlock(&fs->journal.oplock);
+
+    pthread_mutex_lock(&fs->journal.lock);
+    fs->journal.committing = false;
+    if (status == 0 && covered > fs->journal.durable)
+        fs->journal.durable = covered;
+    pthread_cond_broadcast(&fs->journal.committed);
+    pthread_mutex_unlock(&fs->journal.lock);
+    return status;
+}
+
+/**********************************************************************
+  Asynchronous I/O
+  a mount starts ASYNC_WORKERS threads on its first asynchronous
+  request. requests are queued on worker fd % ASYNC_WORKERS, so the
+  requests of one descriptor stay in order while different descriptors
+  run in parallel. the worker makes the synchronous call and then runs
+  the callback or queues the completion and signals the eventfd.
+  vsumount lets the workers drain their queues and stops them.
+***********************************************************************/
+static void async_complete(struct vsfs *fs, async_request *request)
+{
+    request->next = NULL;
+    pthread_mutex_lock(&fs->async.lock);
+    if (fs->async.donetail == NULL)
+        fs->async.donehead = request;
+    else
+        fs->async.donetail->next = request;
+    fs->async.donetail = request;
+    uint64_t one = 1;
+    if (write(fs->async.eventfd, &one, sizeof(one)) != sizeof(one))
+        vsfs_err("failed to signal completion\n");
+    pthread_mutex_unlock(&fs->async.lock);
+}
+
+static void *async_run(void *arg)
+{
+    async_worker *worker = (async_worker *)arg;
+    struct vsfs *fs = worker->fs;
+    pthread_mutex_lock(&worker->lock);
+    for (;;)
+    {
+        while (worker->head == NULL && !worker->stop)
+            pthread_cond_wait(&worker->wakeup, &worker->lock);
+        async_request *request = worker->head;
+        if (request == NULL)
+            break; // stopped and drained
+        worker->head = request->next;
+        if (worker->head == NULL)
+            worker->tail = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        if (request->append)
+            request->status = vsfs_append(fs, request->fd, request->buf, request->n);
+        else
+            request->status = vsfs_read(fs, request->fd, request->buf, request->n);
+        if (request->callback != NULL)
+        {
+            request->callback(request->arg, request->fd, request->status);
+            free(request);
+        }
+        else
+            async_complete(fs, request);
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+// stop the first count workers once their queues are empty
+static void async_join(struct vsfs *fs, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        pthread_mutex_lock(&fs->async.workers[i].lock);
+        fs->async.workers[i].stop = true;
+        pthread_cond_signal(&fs->async.workers[i].wakeup);
+        pthread_mutex_unlock(&fs->async.workers[i].lock);
+    }
+    for (int i = 0; i < count; i++)
+        pthread_join(fs->async.workers[i].thread, NULL);
+}
+
+static int async_start(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->async.lock);
+    if (fs->async.started)
+    {
+        pthread_mutex_unlock(&fs->async.lock);
+        return 0;
+    }
+    if (fs->async.eventfd == -1)
+        fs->async.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int started = 0;
+    while (fs->async.eventfd != -1 && started < ASYNC_WORKERS)
+    {
+        async_worker *worker = &fs->async.workers[started];
+        worker->fs = fs;
+        worker->stop = false;
+        if (pthread_create(&worker->thread, NULL, async_run, (void *)worker) != 0)
+            break;
+        started++;
+    }
+    if (started != ASYNC_WORKERS)
+    {
+        // the workers that did start have nothing queued yet
+        vsfs_err("failed to start async workers\n");
+        async_join(fs, started);
+        pthread_mutex_unlock(&fs->async.lock);
+        return -1;
+    }
+    fs->async.started = true;
+    pthread_mutex_unlock(&fs->async.lock);
+    return 0;
+}
+
+static void async_stop(struct vsfs *fs)
+{
+    pthread_mutex_lock(&fs->async.lock);
+    bool started = fs->async.started;
+    fs->async.started = false;
+    pthread_mutex_unlock(&fs->async.lock);
+    // the workers may still take the engine lock to queue completions
+    if (started)
+        async_join(fs, ASYNC_WORKERS);
+}
+
+static int async_submit(struct vsfs *fs, bool append, int fd, void *buf, int n, vsfs_callback callback, void *arg)
+{
+    if (fs == NULL || fd < 0 || fd >= 128 || n < 0)
+        return -1;
+    if (async_start(fs) == -1)
+        return -1;
+    async_request *request = (async_request *)malloc(sizeof(async_request));
+    if (request == NULL)
+        return -1;
+    request->next = NULL;
+    request->append = append;
+    request->fd = fd;
+    request->buf = buf;
+    request->n = n;
+    request->callback = callback;
+    request->arg = arg;
+    request->status = -1;
+
+    async_worker *worker = &fs->async.workers[fd % ASYNC_WORKERS];
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == NULL)
+        worker->head = request;
+    else
+        worker->tail->next = request;
+    worker->tail = request;
+    pthread_cond_signal(&worker->wakeup);
+    pthread_mutex_unlock(&worker->lock);
+    return 0;
+}
+
+/**********************************************************************
+   The following functions are to be called by applications directly.
+***********************************************************************/
+// write zeros over the data blocks, FORMAT_CHUNK blocks per pwritev
+#define FORMAT_CHUNK 64
+int format_datablocks(struct vsfs *fs, uint32_t count)
+{
+    uint8_t *zeros = (uint8_t *)calloc(FORMAT_CHUNK, fs->blocksize);
+    if (zeros == NULL)
+        return -1;
+    for (uint32_t i = fs->geometry.firstdatablock; i < count; i += FORMAT_CHUNK)
+    {
+        uint32_t n = count - i < FORMAT_CHUNK ? count - i : FORMAT_CHUNK;
+        struct iovec iov = {(void *)zeros, (size_t)n * fs->blocksize};
+        if (dev_transfer(fs, &iov, 1, i, true) == -1)
+        {
+            free(zeros);
+            return -1;
+        }
+    }
+    free(zeros);
+    return 0;
+}
+
+// build the first blockcount metadata blocks in image, which is zeroed:
+// the superblock and the bitmap, where the metadata blocks are marked
+// used. a zeroed FAT block holds FAT_LIST_NULL entries and a zeroed
+// directory block unoccupied entries, so they need nothing more.
+void format_metadata(struct vsfs *fs, uint8_t *image, uint32_t blockcount)
+{
+    vsfs_assert(sizeof(super_block_v2) == 512);
+    vsfs_assert(sizeof(directory_entry) == 128);
+    vsfs_assert(FAT_LIST_NULL == 0 && NO_START_BLOCK == 0);
+    superblock_image(fs, (void *)image);
+    uint64_t *bitmap = (uint64_t *)(image + (size_t)fs->geometry.bitmapstart * fs->blocksize);
+    for (uint32_t b = 0; b < fs->geometry.firstdatablock; b++)
+    {
+        if (fs->geometry.bitmapstart + b / BITMAP_BITS_PER_BLOCK(fs) < blockcount)
+            bitmap[b / 64] |= UINT64_C(1) << (b % 64);
+    }
+}
+
+// this function is partially implemented.
+static int format_disk(struct vsfs *fs, char *vdiskname, unsigned int m, unsigned int blocksize, int flags)
+{
+    // validate m, the block count has to fit the 32 bit block numbers
+    if (m < MIN_DISK_ORDER || m > MAX_DISK_ORDER)
+    {
+        vsfs_err("m value must be between %d and %d only\n", MIN_DISK_ORDER, MAX_DISK_ORDER);
+        return -1;
+    }
+    if (!blocksize_valid(blocksize))
+    {
+        vsfs_err("block size must be a power of two between %d and %d\n", VSFS_MIN_BLOCKSIZE, VSFS_MAX_BLOCKSIZE);
+        return -1;
+    }
+    off_t size;
+    off_t num = 1;
+    uint32_t count;
+    size = num << m;
+    count = size / blocksize;
+    vsfs_info("%u %jd\n", m, (intmax_t)size);
+    uint32_t journalblocks = 0;
+    if (flags & VSFS_FORMAT_JOURNAL)
+        journalblocks = JOURNAL_BYTES / blocksize;
+    geometry_compute(fs, count, blocksize, journalblocks);
+    if (fs->geometry.firstdatablock >= count)
+    {
+        vsfs_err("a %jd byte disk has no room for data blocks of %u bytes\n", (intmax_t)size, blocksize);
+        return -1;
+    }
+
+    // memory map disk
+    fs->fd = open(vdiskname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (ftruncate(fs->fd, size) != 0)
+    {
+        vsfs_err("failed to truncate vdisk\n");
+        return -1;
+    }
+
+    struct stat sb;
+    if (fstat(fs->fd, &sb))
+    {
+        vsfs_err("failed to get vdisk size info\n");
+        return -1;
+    }
+    vsfs_info("vsdisk size: %ld\n", sb.st_size);
+    vsfs_assert(sb.st_size == size);
+    // the file is all holes now, which read as zeros. the metadata goes
+    // out in one pwritev. a sparse format writes only the superblock and
+    // the bitmap blocks that mark metadata, everything else stays a hole.
+    bool sparse = (flags & VSFS_FORMAT_SPARSE) != 0;
+    uint32_t metadatablocks = fs->geometry.firstdatablock;
+    if (sparse)
+        metadatablocks = fs->geometry.bitmapstart + (fs->geometry.firstdatablock - 1) / BITMAP_BITS_PER_BLOCK(fs) + 1;
+    uint8_t *image = (uint8_t *)calloc(metadatablocks, fs->blocksize);
+    if (image == NULL)
+    {
+        close(fs->fd);
+        return -1;
+    }
+    format_metadata(fs, image, metadatablocks);
+    struct iovec iov = {(void *)image, (size_t)metadatablocks * fs->blocksize};
+    int status = dev_transfer(fs, &iov, 1, 0, true);
+    free(image);
+    if (status == 0 && !sparse)
+        status = format_datablocks(fs, count);
+    if (status == -1)
+    {
+        close(fs->fd);
+        return -1;
+    }
+    close(fs->fd);
+    return (0);
+}
+
+int vsformat_ex(char *vdiskname, unsigned int m, unsigned int blocksize, int flags)
+{
+    // geometry and I/O work on a mount, format gets one of its own
+    struct vsfs *fs = (struct vsfs *)calloc(1, sizeof(struct vsfs));
+    if (fs == NULL)
+        return -1;
+    int status = format_disk(fs, vdiskname, m, blocksize, flags);
+    free(fs);
+    return status;
+}
+
+int vsformat(char *vdiskname, unsigned int m)
+{
+    return vsformat_ex(vdiskname, m, BLOCKSIZE, 0);
+}
+
+// read the FAT into the dense in-memory table. a v2 FAT is read
+// straight into it, a v1 FAT is spread out by FAT_BLOCK/FAT_OFFSET.
+int fattable_load(struct vsfs *fs)
+{
+    uint32_t entries = fs->geometry.fatblocks * FAT_ENTRIES_PER_BLOCK(fs);
+    if (entries < fs->geometry.blockcount)
+        entries = fs->geometry.blockcount;
+    fs->fattable = (uint32_t *)calloc(entries, sizeof(uint32_t));
+    if (fs->fattable == NULL)
+        return -1;
+    if (fs->geometry.version != 1)
+    {
+        struct iovec iov = {(void *)fs->fattable, (size_t)fs->geometry.fatblocks * fs->blocksize};
+        return dev_transfer(fs, &iov, 1, fs->geometry.fatstart, false);
+    }
+    fat_table_block *blocks = (fat_table_block *)malloc(sizeof(fat_table_block) * fs->geometry.fatblocks);
+    if (blocks == NULL)
+        return -1;
+    struct iovec iov = {(void *)blocks, sizeof(fat_table_block) * fs->geometry.fatblocks};
+    int status = dev_transfer(fs, &iov, 1, fs->geometry.fatstart, false);
+    for (uint32_t b = 0; b < fs->geometry.blockcount && status == 0; b++)
+        fs->fattable[b] = blocks[FAT_BLOCK(b)].entries[FAT_OFFSET(b)];
+    free(blocks);
+    return status;
+}
+
+void metadata_destroy(struct vsfs *fs)
+{
+    free(fs->fattable);
+    free(fs->rootdir);
+    free(fs->metadata_dirty);
+    free(fs->allocator.freemap);
+    fs->fattable = NULL;
+    fs->rootdir = NULL;
+    fs->metadata_dirty = NULL;
+    fs->allocator.freemap = NULL;
+}
+
+// this function is partially implemented.
+static int mount_disk(struct vsfs *fs, char *vdiskname, int flags)
+{
+    // open the Linux file vdiskname and in this
+    // way make it ready to be used for other operations.
+    // fs->fd is kept in the mount; hence other function can use it.
+    fs->fd = open(vdiskname, O_RDWR);
+    if (fs->fd == -1)
+    {
+        vsfs_err("failed to open vdisk %s\n", vdiskname);
+        return -1;
+    }
+
+    if (flags & VSFS_MOUNT_MMAP)
+    {
+        // map the whole vdisk, read_block and write_block then copy
+        // straight from and to the mapping without any syscall
+        struct stat sb;
+        if (fstat(fs->fd, &sb))
+        {
+            vsfs_err("failed to get vdisk size info\n");
+            return -1;
+        }
+        void *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            vsfs_err("failed to map vdisk\n");
+            return -1;
+        }
+        fs->map = (uint8_t *)map;
+        fs->mapsize = sb.st_size;
+    }
+
+    // load (chache) the superblock info from disk (Linux file) into memory
+    // load the FAT table from disk into memory
+    // load root directory from disk into memory
+    // metadata has its own in-memory copy, so it bypasses the block cache
+
+    // the superblock is within the first BLOCKSIZE bytes whatever the
+    // block size of the disk is, the smallest disk has more than that
+    fs->blocksize = BLOCKSIZE;
+    uint8_t *block = new_datablock(fs);
+    int status = dev_read_block(fs, (void *)block, 0);
+    if (status == 0)
+        status = geometry_load(fs, (void *)block);
+    free(block);
+    if (status == -1)
+        return -1;
+    vsfs_info("on mount, block size: %u\n", fs->blocksize);
+
+    if (cache_init(fs, fs->map != NULL ? 0 : cache_configuredsize) == -1)
+    {
+        vsfs_err("failed to allocate block cache\n");
+        return -1;
+    }
+    vsfs_info("on mount, vdisk version: %u\n", fs->geometry.version);
+    vsfs_info("on mount, superblock block count: %u\n", fs->geometry.blockcount);
+
+    fs->metadata_dirty = (bool *)calloc(fs->geometry.firstdatablock, sizeof(bool));
+    fs->rootdir = (directory_entry *)malloc((size_t)fs->blocksize * fs->geometry.rootdirblocks);
+    fs->allocator.words = allocator_words(fs);
+    fs->allocator.freemap = (uint64_t *)calloc(fs->allocator.words, sizeof(uint64_t));
+    if (fs->metadata_dirty == NULL || fs->rootdir == NULL || fs->allocator.freemap == NULL)
+        return -1;
+    if (fs->geometry.version != 1)
+    {
+        struct iovec iov = {(void *)fs->allocator.freemap, (size_t)fs->geometry.bitmapblocks * fs->blocksize};
+        if (dev_transfer(fs, &iov, 1, fs->geometry.bitmapstart, false) == -1)
+            return -1;
+    }
+    allocator_load(fs);
+
+    struct iovec iov = {(void *)fs->rootdir, (size_t)fs->blocksize * fs->geometry.rootdirblocks};
+    status = dev_transfer(fs, &iov, 1, fs->geometry.rootdirstart, false);
+    if (status == -1)
+    {
+        return -1;
+    }
+    // print_dir(print_rootdir);
+
+    status = fattable_load(fs);
+    if (status == -1)
+        return -1;
+    print_table(print_fattable);
+
+    // committed changes that did not make it home yet
+    uint8_t *records = NULL;
+    size_t recordbytes = 0;
+    if (fs->geometry.journalblocks != 0)
+    {
+        if (journal_read(fs, &records, &recordbytes) == -1)
+        {
+            vsfs_err("failed to read journal\n");
+            free(records);
+            return -1;
+        }
+        journal_apply(fs, records, recordbytes, false);
+    }
+    if (directory_load(fs) == -1)
+    {
+        vsfs_err("failed to load directory\n");
+        free(records);
+        return -1;
+    }
+    journal_apply(fs, records, recordbytes, true);
+    free(records);
+    if (dirindex_build(fs) == -1)
+    {
+        vsfs_err("failed to build directory index\n");
+        return -1;
+    }
+    if (tailpack_load(fs) == -1 || share_load(fs) == -1)
+        return -1;
+    if (fs->geometry.journalblocks != 0)
+    {
+        vsfs_info("on mount, replayed %zu journal bytes\n", recordbytes);
+        if (recordbytes != 0 && journal_checkpoint(fs) == -1)
+            return -1;
+        fs->journal.active = true;
+    }
+
+    return (0);
+}
+
+// undo mount_disk, whether it got all the way through or not
+static void mount_release(struct vsfs *fs)
+{
+    // completions nobody polled for
+    while (fs->async.donehead != NULL)
+    {
+        async_request *request = fs->async.donehead;
+        fs->async.donehead = request->next;
+        free(request);
+    }
+    if (fs->async.eventfd != -1)
+        close(fs->async.eventfd);
+    for (int i = 0; i < ASYNC_WORKERS; i++)
+    {
+        pthread_mutex_destroy(&fs->async.workers[i].lock);
+        pthread_cond_destroy(&fs->async.workers[i].wakeup);
+    }
+    pthread_mutex_destroy(&fs->async.lock);
+    free(fs->journal.fat.keys);
+    free(fs->journal.bitmap.keys);
+    free(fs->journal.dirslots.keys);
+    pthread_rwlock_destroy(&fs->journal.oplock);
+    pthread_mutex_destroy(&fs->journal.lock);
+    pthread_cond_destroy(&fs->journal.committed);
+
+    // descriptors do not survive the unmount
+    for (int i = 0; i < 128; i++)
+    {
+        free(fs->openfiletable[i].readbuf);
+        free(fs->openfiletable[i].tailbuf);
+        blockindex_destroy(&fs->openfiletable[i]);
+        pthread_mutex_destroy(&fs->openfiletable[i].lock);
+    }
+    cache_destroy(fs);
+    tailpack_destroy(fs);
+    refcount_destroy(&fs->shares);
+    dirindex_destroy(fs);
+    directory_destroy(fs);
+    metadata_destroy(fs);
+    if (fs->map != NULL)
+        munmap(fs->map, fs->mapsize);
+    if (fs->fd != -1)
+        close(fs->fd);
+    for (int i = 0; i < FAT_LOCKS; i++)
+        pthread_mutex_destroy(&fs->fatlocks[i]);
+    pthread_mutex_destroy(&fs->metalock);
+    pthread_mutex_destroy(&fs->openlock);
+    pthread_mutex_destroy(&fs->allocator.lock);
+    pthread_mutex_destroy(&fs->blockcache.lock);
+    pthread_mutex_destroy(&fs->pack.lock);
+    pthread_mutex_destroy(&fs->sharelock);
+    pthread_rwlock_destroy(&fs->lock);
+    free(fs);
+}
+
+vsfs_t *vsfs_mount(char *vdiskname, int flags)
+{
+    vsfs_clock(start);
+    struct vsfs *fs = (struct vsfs *)calloc(1, sizeof(struct vsfs));
+    if (fs == NULL)
+        return NULL;
+    fs->fd = -1;
+    pthread_rwlock_init(&fs->lock, NULL);
+    pthread_mutex_init(&fs->openlock, NULL);
+    pthread_mutex_init(&fs->metalock, NULL);
+    pthread_mutex_init(&fs->allocator.lock, NULL);
+    pthread_mutex_init(&fs->blockcache.lock, NULL);
+    pthread_mutex_init(&fs->pack.lock, NULL);
+    pthread_mutex_init(&fs->sharelock, NULL);
+    for (int i = 0; i < FAT_LOCKS; i++)
+        pthread_mutex_init(&fs->fatlocks[i], NULL);
+    pthread_mutex_init(&fs->async.lock, NULL);
+    fs->async.eventfd = -1;
+    pthread_rwlock_init(&fs->journal.oplock, NULL);
+    pthread_mutex_init(&fs->journal.lock, NULL);
+    pthread_cond_init(&fs->journal.committed, NULL);
+    for (int i = 0; i < ASYNC_WORKERS; i++)
+    {
+        pthread_mutex_init(&fs->async.workers[i].lock, NULL);
+        pthread_cond_init(&fs->async.workers[i].wakeup, NULL);
+    }
+    for (int i = 0; i < 128; i++)
+    {
+        pthread_mutex_init(&fs->openfiletable[i].lock, NULL);
+        fs->openfiletable[i].free = true;
+    }
+    if (mount_disk(fs, vdiskname, flags) == -1)
+    {
+        mount_release(fs);
+        return NULL;
+    }
+    vsfs_latency(fs, VSFS_CALL_MOUNT, start);
+    return fs;
+}
+
+static int sync_disk(struct vsfs *fs)
+{
+    for (int i = 0; i < 128; i++)
+    {
+        if (!fs->openfiletable[i].free && flush_tail(fs, &fs->openfiletable[i]) == -1)
+            return -1;
+    }
+    if (fs->journal.active)
+        return journal_checkpoint(fs);
+    return sync_home(fs);
+}
+
+int vsfs_sync(vsfs_t *fs)
+{
+    if (fs == NULL)
+        return -1;
+    vsfs_clock(start);
+    pthread_rwlock_wrlock(&fs->lock);
+    int status = sync_disk(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    vsfs_latency(fs, VSFS_CALL_SYNC, start);
+    return status;
+}
+
+// this function is partially implemented.
+int vsfs_umount(vsfs_t *fs)
+{
+    if (fs == NULL)
+        return -1;
+    async_stop(fs);
+    pthread_rwlock_wrlock(&fs->lock);
+    int status = sync_disk(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    if (status == -1)
+        return -1;
+    mount_release(fs);
+    return (0);
+}
+
+static int create_file(struct vsfs *fs, char *filename)
+{
+    int length = strlen(filename);
+    if (length >= 30 || length == 0)
+    {
+        return -1;
+    }
+
+    vsfs_info("creating file with name %s\n", filename);
+    if (dirindex_lookup(fs, filename) != -1)
+        return -1;
+    if (fs->dirindex.freecount == 0 && directory_grow(fs) == -1)
+        return -1;
+
+    int32_t slot = fs->dirindex.freeslots[--fs->dirindex.freecount];
+    directory_entry *entry = dirent(fs, slot);
+    entry->isoccupied = true;
+    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+    entry->filename[sizeof(entry->filename) - 1] = '\0';
+    entry->filesize = 0;
+    entry->startblock = NO_START_BLOCK;
+    entry->flags = 0;
+    mark_dirslot_dirty(fs, slot);
+    dirindex_insert(fs, entry->filename, slot);
+    vsfs_info("vscreate: file-> isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
+              entry->isoccupied, entry->startblock, entry->filesize, entry->filename);
+    return 0;
+}
+
+int vsfs_create(vsfs_t *fs, char *filename)
+{
+    if (fs == NULL)
+        return -1;
+    vsfs_clock(start);
+    pthread_rwlock_wrlock(&fs->lock);
+    journal_begin(fs);
+    int status = create_file(fs, filename);
+    journal_end(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    if (status == 0)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_CREATE, start);
+    return status;
+}
+
+static int open_file(struct vsfs *fs, char *file, int mode)
+{
+    int32_t slot = dirindex_lookup(fs, file);
+    if (slot == -1)
+        return -1;
+    directory_entry *entry = dirent(fs, slot);
+
+    // a file that is already open keeps its descriptor
+    int tableoffset = -1;
+    for (int i = 0; i < 128; i++)
+    {
+        if (!fs->openfiletable[i].free && fs->openfiletable[i].slot == slot)
+        {
+            // if already opened, check for mode
+            if (fs->openfiletable[i].mode != mode)
+                return -1;
+            return i;
+        }
+        if (fs->openfiletable[i].free && tableoffset == -1)
+            tableoffset = i;
+    }
+    if (tableoffset == -1)
+        return -1;
+
+    openfiletable_entry *openfile = &fs->openfiletable[tableoffset];
+    pthread_mutex_lock(&openfile->lock);
+    openfile->offset = 0;
+    openfile->currblock = entry->startblock;
+    openfile->readbuf = NULL;
+    openfile->readbufblock = NO_START_BLOCK;
+    openfile->blockindex = NULL;
+    openfile->blockindexcount = 0;
+    openfile->readaheadnext = 0;
+    openfile->readaheadwindow = 0;
+    openfile->readaheadend = 0;
+    openfile->tailblock = NO_START_BLOCK;
+    openfile->tailbuf = NULL;
+    openfile->taildirty = false;
+    openfile->entry = entry;
+    openfile->slot = slot;
+    openfile->mode = mode;
+    openfile->free = false;
+    pthread_mutex_unlock(&openfile->lock);
+
+    vsfs_info("vsopen: file-> isoccupied: %d, start block: %d, filesize: %ld, filename: %s\n",
+              entry->isoccupied, entry->startblock, entry->filesize, entry->filename);
+    return tableoffset;
+}
+
+int vsfs_open(vsfs_t *fs, char *file, int mode)
+{
+    if (fs == NULL)
+        return -1;
+    vsfs_clock(start);
+    pthread_rwlock_rdlock(&fs->lock);
+    pthread_mutex_lock(&fs->openlock);
+    int fd = open_file(fs, file, mode);
+    pthread_mutex_unlock(&fs->openlock);
+    pthread_rwlock_unlock(&fs->lock);
+    vsfs_latency(fs, VSFS_CALL_OPEN, start);
+    return fd;
+}
+
+int vsfs_close(vsfs_t *fs, int fd)
+{
+    if (fs == NULL || fd < 0 || fd >= 128)
+        return -1;
+    vsfs_clock(start);
+    pthread_rwlock_rdlock(&fs->lock);
+    pthread_mutex_lock(&fs->openlock);
+    openfiletable_entry *openfile = &fs->openfiletable[fd];
+    pthread_mutex_lock(&openfile->lock);
+    int status = -1;
+    int packed = 0;
+    if (!openfile->free)
+    {
+        journal_begin(fs);
+        packed = tail_pack(fs, openfile);
+        journal_end(fs);
+        status = flush_tail(fs, openfile);
+        free(openfile->readbuf);
+        openfile->readbuf = NULL;
+        free(openfile->tailbuf);
+        openfile->tailbuf = NULL;
+        blockindex_destroy(openfile);
+        openfile->free = true;
+    }
+    pthread_mutex_unlock(&openfile->lock);
+    pthread_mutex_unlock(&fs->openlock);
+    pthread_rwlock_unlock(&fs->lock);
+    if (status == 0 && packed == 1)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_CLOSE, start);
+    if (status == -1)
+        return -1;
+    return (0);
+}
+
+static void openfile_unlock(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    pthread_mutex_unlock(&openfile->lock);
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+// descriptor fd, locked for one operation on its file with the mount
+// held shared, NULL if fd is not open. release with openfile_unlock.
+static openfiletable_entry *openfile_lock(struct vsfs *fs, int fd)
+{
+    if (fs == NULL || fd < 0 || fd >= 128)
+        return NULL;
+    pthread_rwlock_rdlock(&fs->lock);
+    openfiletable_entry *openfile = &fs->openfiletable[fd];
+    pthread_mutex_lock(&openfile->lock);
+    if (openfile->free)
+    {
+        openfile_unlock(fs, openfile);
+        return NULL;
+    }
+    return openfile;
+}
+
+long vsfs_size(vsfs_t *fs, int fd)
+{
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    long size = openfile->entry->filesize;
+    openfile_unlock(fs, openfile);
+    vsfs_latency(fs, VSFS_CALL_SIZE, start);
+    return size;
+}
+
+// read n bytes from the blocks of the FAT chain at the cursor
+static int file_readblocks(struct vsfs *fs, openfiletable_entry *openfile, void *buf, int n)
+{
+    bool sequential = openfile->offset == openfile->readaheadnext;
+
+    vsfs_info("reading file %s\n", openfile->entry->filename);
+    // map buffer to underyling bytestream
+    uint8_t *bytestream = (uint8_t *)buf;
+
+    // walk the blocks the read touches and queue the ones that are not
+    // buffered already: whole blocks go straight into the caller's buffer,
+    // a partial block at the end into the descriptor's read buffer, and a
+    // partial block at the start (if more follows) into a scratch block
+    blockio_batch batch;
+    batch_init(&batch, false);
+    uint8_t *scratch = NULL;
+    int scratchoffset = 0, scratchspan = 0;
+    int readbufdst = -1, readbufoffset = 0, readbufspan = 0;
+    uint32_t readbufblockpending = NO_START_BLOCK;
+    if (openfile->readbuf == NULL)
+    {
+        openfile->readbuf = new_datablock(fs);
+        openfile->readbufblock = NO_START_BLOCK;
+    }
+
+    int copied = 0;
+    while (copied < n)
+    {
+        int blockoffset = openfile->offset % fs->blocksize;
+        int span = fs->blocksize - blockoffset;
+        if (span > n - copied)
+            span = n - copied;
+
+        if (span == (int)fs->blocksize)
+        {
+            uint32_t runlength = chain_run(fs, openfile->entry, openfile->currblock, (n - copied) / fs->blocksize);
+            if (batch_add(fs, &batch, (void *)(bytestream + copied), openfile->currblock, runlength) == -1)
+                return -1;
+            span = runlength * fs->blocksize;
+            openfile->currblock += runlength - 1;
+        }
+        else if (openfile->readbufblock == openfile->currblock)
+        {
+            memcpy(bytestream + copied, openfile->readbuf + blockoffset, span);
+        }
+        else if (copied + span == n)
+        {
+            openfile->readbufblock = NO_START_BLOCK; // refilled below
+            if (batch_add(fs, &batch, (void *)openfile->readbuf, openfile->currblock, 1) == -1)
+                return -1;
+            readbufdst = copied;
+            readbufoffset = blockoffset;
+            readbufspan = span;
+            readbufblockpending = openfile->currblock;
+        }
+        else
+        {
+            scratch = new_datablock(fs);
+            if (batch_add(fs, &batch, (void *)scratch, openfile->currblock, 1) == -1)
+            {
+                free(scratch);
+                return -1;
+            }
+            scratchoffset = blockoffset;
+            scratchspan = span;
+        }
+        copied += span;
+        openfile->offset += span;
+        if (openfile->offset % fs->blocksize == 0)
+        {
+            // crossed into the next block of the chain
+            uint32_t currblock = openfile->currblock;
+            openfile->currblock = file_nextblock(fs, openfile->entry, currblock);
+            vsfs_count(fs, fathops, 1);
+        }
+    }
+    int status = batch_submit(fs, &batch);
+    if (status == 0 && scratch != NULL)
+        memcpy(bytestream, scratch + scratchoffset, scratchspan);
+    if (status == 0 && readbufdst != -1)
+    {
+        memcpy(bytestream + readbufdst, openfile->readbuf + readbufoffset, readbufspan);
+        openfile->readbufblock = readbufblockpending;
+    }
+    free(scratch);
+    if (status == 0)
+        readahead_update(fs, openfile, sequential);
+    return status;
+}
+
+// read n bytes of a packed tail at the cursor. the pack block is kept in
+// the read buffer, no chain block is ever read into it under that number.
+static int file_readtail(struct vsfs *fs, openfiletable_entry *openfile, uint8_t *buf, int n)
+{
+    directory_entry *entry = openfile->entry;
+    if (openfile->readbuf == NULL)
+    {
+        openfile->readbuf = new_datablock(fs);
+        openfile->readbufblock = NO_START_BLOCK;
+    }
+    if (openfile->readbufblock != entry->packblock)
+    {
+        openfile->readbufblock = NO_START_BLOCK;
+        if (read_block(fs, (void *)openfile->readbuf, entry->packblock) == -1)
+            return -1;
+        openfile->readbufblock = entry->packblock;
+    }
+    memcpy(buf, openfile->readbuf + entry->tailoffset + openfile->offset % fs->blocksize, n);
+    openfile->offset += n;
+    return 0;
+}
+
+static int file_read(struct vsfs *fs, openfiletable_entry *openfile, void *buf, int n)
+{
+    if (openfile->mode != MODE_READ)
+        return -1;
+    if (n < 0)
+        return -1;
+
+    uintmax_t filesize = openfile->entry->filesize;
+    if (filesize == 0)
+    {
+        vsfs_assert(openfile->entry->startblock == NO_START_BLOCK);
+        return 0;
+    }
+    if (openfile->offset >= filesize)
+        return 0;
+    if ((uintmax_t)n > filesize - openfile->offset)
+        n = filesize - openfile->offset;
+    if (openfile->entry->flags & DIRENT_INLINE)
+    {
+        memcpy(buf, openfile->entry->inlinedata + openfile->offset, n);
+        openfile->offset += n;
+        return 0;
+    }
+    int tailbytes = 0;
+    if (openfile->entry->flags & DIRENT_PACKED)
+    {
+        // the bytes after the last whole block are in the pack block
+        uintmax_t tailstart = filesize - filesize % fs->blocksize;
+        if (openfile->offset + n > tailstart)
+            tailbytes = openfile->offset + n - (openfile->offset > tailstart ? openfile->offset : tailstart);
+    }
+    int status = 0;
+    if (n > tailbytes)
+        status = file_readblocks(fs, openfile, buf, n - tailbytes);
+    if (status == 0 && tailbytes > 0)
+        status = file_readtail(fs, openfile, (uint8_t *)buf + n - tailbytes, tailbytes);
+    return status;
+}
+
+int vsfs_read(vsfs_t *fs, int fd, void *buf, int n)
+{
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    int status = file_read(fs, openfile, buf, n);
+    openfile_unlock(fs, openfile);
+    vsfs_latency(fs, VSFS_CALL_READ, start);
+    return status;
+}
+
+// move the read cursor of the file, like lseek. offsets past the end
+// of the file are refused. returns the new offset.
+static long file_seek(struct vsfs *fs, openfiletable_entry *openfile, long offset, int whence)
+{
+    if (openfile->mode != MODE_READ)
+        return -1;
+
+    intmax_t target = offset;
+    if (whence == SEEK_CUR)
+        target += openfile->offset;
+    else if (whence == SEEK_END)
+        target += openfile->entry->filesize;
+    else if (whence != SEEK_SET)
+        return -1;
+    if (target < 0 || (uintmax_t)target > openfile->entry->filesize)
+        return -1;
+    if (blockindex_build(fs, openfile) == -1)
+        return -1;
+
+    uintmax_t logical = (uintmax_t)target / fs->blocksize;
+    openfile->offset = target;
+    openfile->currblock = logical < openfile->blockindexcount ? openfile->blockindex[logical] : FAT_LIST_NULL;
+    return target;
+}
+
+long vsfs_seek(vsfs_t *fs, int fd, long offset, int whence)
+{
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    long target = file_seek(fs, openfile, offset, whence);
+    openfile_unlock(fs, openfile);
+    vsfs_latency(fs, VSFS_CALL_SEEK, start);
+    return target;
+}
+
+// read n bytes at offset without moving the read cursor
+int vsfs_pread(vsfs_t *fs, int fd, void *buf, int n, long offset)
+{
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    uintmax_t cursor = openfile->offset;
+    uint32_t cursorblock = openfile->currblock;
+    // a sequential reader keeps its readahead across positional reads
+    uintmax_t readaheadnext = openfile->readaheadnext;
+    uint32_t readaheadwindow = openfile->readaheadwindow;
+    uintmax_t readaheadend = openfile->readaheadend;
+    int status = -1;
+    if (file_seek(fs, openfile, offset, SEEK_SET) != -1)
+        status = file_read(fs, openfile, buf, n);
+    openfile->offset = cursor;
+    openfile->currblock = cursorblock;
+    openfile->readaheadnext = readaheadnext;
+    openfile->readaheadwindow = readaheadwindow;
+    openfile->readaheadend = readaheadend;
+    openfile_unlock(fs, openfile);
+    vsfs_latency(fs, VSFS_CALL_PREAD, start);
+    return status;
+}
+
+// link blockcount whole blocks from bytestream after prevblock, which is
+// the current last block of the file (NO_START_BLOCK for an empty file).
+// blocks are reserved in contiguous runs, preferably right after
+// prevblock, and queued on batch so that each run is one pwritev.
+// returns the number of blocks appended, fewer than blockcount if the
+// disk fills up, -1 on a write error. *lastblock is left at the new last
+// block of the chain.
+int itervative_append(
+    struct vsfs *fs,
+    int32_t slot,
+    uint32_t prevblock,
+    uint8_t *bytestream,
+    int blockcount,
+    uint32_t *lastblock,
+    blockio_batch *batch)
+{
+    uint32_t prevblocknumber = prevblock;
+    int appended = 0;
+    while (appended < blockcount)
+    {
+        uint32_t runlength;
+        uint32_t runstart = get_freeextent(fs, blockcount - appended, prevblocknumber + 1, &runlength);
+        if (runstart == 0)
+        {
+            vsfs_err("no free block left for append\n");
+            break;
+        }
+        if (file_link(fs, slot, prevblocknumber, runstart) == -1)
+        {
+            for (uint32_t i = 0; i < runlength; i++)
+                release_block(fs, runstart + i);
+            return -1;
+        }
+        for (uint32_t i = 0; i + 1 < runlength; i++)
+            fat_set(fs, runstart + i, runstart + i + 1);
+        fat_set(fs, runstart + runlength - 1, FAT_LIST_NULL);
+        prevblocknumber = runstart + runlength - 1;
+        *lastblock = prevblocknumber;
+        if (batch_add(fs, batch, (void *)(bytestream + (size_t)appended * fs->blocksize), runstart, runlength) == -1)
+            return -1;
+        appended += runlength;
+    }
+    *lastblock = prevblocknumber;
+    return appended;
+}
+
+static int file_appendblocks(struct vsfs *fs, openfiletable_entry *openfile, void *buf, int n)
+{
+    directory_entry *entry = openfile->entry;
+    uint8_t *bytestream = (uint8_t *)buf;
+
+    if (openfile->tailbuf == NULL)
+    {
+        // first append through this descriptor, find and load the tail once
+        openfile->tailbuf = new_datablock(fs);
+        openfile->tailblock = get_lastallocatedblock(fs, entry);
+        openfile->taildirty = false;
+        if (entry->filesize % fs->blocksize != 0)
+        {
+            if (read_block(fs, (void *)openfile->tailbuf, openfile->tailblock) == -1)
+                return -1;
+        }
+    }
+
+    if (n > 0)
+        mark_dirslot_dirty(fs, openfile->slot); // the size is about to change
+
+    // a tail block that fills up in front of whole blocks is queued
+    // together with them, so that it shares their pwritev
+    blockio_batch batch;
+    batch_init(&batch, true);
+    int copied = 0;
+    while (copied < n)
+    {
+        int blockoffset = entry->filesize % fs->blocksize;
+        if (blockoffset == 0)
+        {
+            // the tail block is full (or there is none yet)
+            int blockcount = (n - copied) / fs->blocksize;
+            if (blockcount > 0)
+            {
+                // whole blocks go to disk directly from the caller's buffer
+                uint32_t lastblock = openfile->tailblock;
+                int appended = itervative_append(fs,
+                    openfile->slot, openfile->tailblock, bytestream + copied, blockcount, &lastblock, &batch);
+                openfile->tailblock = lastblock;
+                if (appended == -1)
+                    return -1;
+                entry->filesize += (uintmax_t)appended * fs->blocksize;
+                copied += appended * fs->blocksize;
+                if (appended != blockcount)
+                {
+                    batch_submit(fs, &batch);
+                    return -1;
+                }
+                continue;
+            }
+            // the old tail may still be queued, send it before reusing tailbuf
+            if (batch_submit(fs, &batch) == -1)
+                return -1;
+            uint32_t runlength;
+            uint32_t newblock = get_freeextent(fs, 1, openfile->tailblock + 1, &runlength);
+            if (newblock == 0)
+            {
+                vsfs_err("no free block left for append\n");
+                return -1;
+            }
+            fat_set(fs, newblock, FAT_LIST_NULL);
+            if (file_link(fs, openfile->slot, openfile->tailblock, newblock) == -1)
+            {
+                release_block(fs, newblock);
+                return -1;
+            }
+            openfile->tailblock = newblock;
+            memset(openfile->tailbuf, 0, fs->blocksize);
+        }
+
+        int span = fs->blocksize - blockoffset;
+        if (span > n - copied)
+            span = n - copied;
+        memcpy(openfile->tailbuf + blockoffset, bytestream + copied, span);
+        openfile->taildirty = true;
+        entry->filesize += span;
+        copied += span;
+        if (entry->filesize % fs->blocksize == 0)
+        {
+            if (n - copied >= (int)fs->blocksize)
+            {
+                if (batch_add(fs, &batch, (void *)openfile->tailbuf, openfile->tailblock, 1) == -1)
+                    return -1;
+                openfile->taildirty = false;
+            }
+            else if (flush_tail(fs, openfile) == -1)
+                return -1;
+        }
+    }
+    return batch_submit(fs, &batch);
+}
+
+// whether n more bytes keep the file of entry in its directory entry.
+// v1 disks keep their original layout, which has no flags.
+static bool inline_fits(struct vsfs *fs, directory_entry *entry, int n)
+{
+    if (fs->geometry.version == 1)
+        return false;
+    if (!(entry->flags & DIRENT_INLINE) && (entry->filesize != 0 || entry->startblock != NO_START_BLOCK))
+        return false;
+    return entry->filesize + n <= INLINE_BYTES;
+}
+
+// add n bytes at the end of the file
+static int file_extend(struct vsfs *fs, openfiletable_entry *openfile, void *buf, int n)
+{
+    if (n < 0)
+        return -1;
+    if (n == 0)
+        return 0;
+
+    directory_entry *entry = openfile->entry;
+    if (inline_fits(fs, entry, n))
+    {
+        memcpy(entry->inlinedata + entry->filesize, buf, n);
+        entry->filesize += n;
+        entry->flags |= DIRENT_INLINE;
+        mark_dirslot_dirty(fs, openfile->slot);
+        return 0;
+    }
+    if (entry->flags & DIRENT_INLINE)
+    {
+        // outgrown, the inline bytes become the start of the first block
+        uint8_t moved[INLINE_BYTES];
+        int size = entry->filesize;
+        memcpy(moved, entry->inlinedata, size);
+        memset(entry->inlinedata, 0, INLINE_BYTES);
+        entry->flags &= ~DIRENT_INLINE;
+        entry->filesize = 0;
+        if (file_appendblocks(fs, openfile, moved, size) == -1)
+            return -1;
+    }
+    else
+    {
+        if ((entry->flags & DIRENT_SHARED) && append_prepare(fs, openfile) == -1)
+            return -1;
+        if ((entry->flags & DIRENT_PACKED) && tail_unpack(fs, openfile) == -1)
+            return -1;
+    }
+    return file_appendblocks(fs, openfile, buf, n);
+}
+
+static int file_append(struct vsfs *fs, openfiletable_entry *openfile, void *buf, int n)
+{
+    if (openfile->mode != MODE_APPEND)
+        return -1;
+    return file_extend(fs, openfile, buf, n);
+}
+
+// put newblock, a copy of the shared block oldblock, in its place in
+// the chain after prevblock. -1 if that needs a second fork.
+static int block_replace(struct vsfs *fs, openfiletable_entry *openfile, uint32_t prevblock, uint32_t oldblock, uint32_t newblock)
+{
+    directory_entry *entry = openfile->entry;
+    fat_set(fs, newblock, file_nextblock(fs, entry, oldblock));
+    if ((entry->flags & DIRENT_FORKED) && entry->forkblock == oldblock)
+    {
+        // the copy is private, its FAT entry takes the fork
+        entry->flags &= ~DIRENT_FORKED;
+        entry->forkblock = 0;
+        entry->forknext = 0;
+        mark_dirslot_dirty(fs, openfile->slot);
+    }
+    if (file_link(fs, openfile->slot, prevblock, newblock) == -1)
+    {
+        fat_set(fs, newblock, FAT_LIST_NULL);
+        return -1;
+    }
+    // the other owners may have let go since it was copied
+    if (!share_drop(fs, oldblock))
+        release_block(fs, oldblock);
+    return 0;
+}
+
+// write n bytes at offset, all of them inside the file. only the blocks
+// touched are written, shared ones go to a copy.
+static int file_overwrite(struct vsfs *fs, openfiletable_entry *openfile, uint8_t *bytes, int n, uintmax_t offset)
+{
+    directory_entry *entry = openfile->entry;
+    if (entry->flags & DIRENT_INLINE)
+    {
+        memcpy(entry->inlinedata + offset, bytes, n);
+        mark_dirslot_dirty(fs, openfile->slot);
+        return 0;
+    }
+    uintmax_t tailstart = entry->filesize - entry->filesize % fs->blocksize;
+    if ((entry->flags & DIRENT_PACKED) && offset + n > tailstart)
+    {
+        // the tail is written in a block of its own
+        if ((entry->flags & DIRENT_SHARED) && append_prepare(fs, openfile) == -1)
+            return -1;
+        if (tail_unpack(fs, openfile) == -1)
+            return -1;
+    }
+    if ((entry->flags & DIRENT_SHARED) && openfile->tailbuf != NULL && block_shared(fs, openfile->tailblock))
+    {
+        // a shared tail buffer is clean, it is read again when needed
+        free(openfile->tailbuf);
+        openfile->tailbuf = NULL;
+        openfile->tailblock = NO_START_BLOCK;
+    }
+
+    uint32_t prevblock = NO_START_BLOCK;
+    uint32_t currblock = entry->startblock;
+    for (uintmax_t logical = 0; logical < offset / fs->blocksize; logical++)
+    {
+        prevblock = currblock;
+        currblock = file_nextblock(fs, entry, currblock);
+    }
+    vsfs_count(fs, fathops, offset / fs->blocksize);
+
+    uint8_t *block = new_datablock(fs);
+    if (block == NULL)
+        return -1;
+    int written = 0;
+    while (written < n)
+    {
+        uint32_t blockoffset = (offset + written) % fs->blocksize;
+        int span = fs->blocksize - blockoffset;
+        if (span > n - written)
+            span = n - written;
+        if (openfile->tailbuf != NULL && currblock == openfile->tailblock)
+        {
+            memcpy(openfile->tailbuf + blockoffset, bytes + written, span);
+            openfile->taildirty = true;
+        }
+        else
+        {
+            uint32_t target = currblock;
+            if ((entry->flags & DIRENT_SHARED) && block_shared(fs, currblock))
+            {
+                uint32_t runlength;
+                target = get_freeextent(fs, 1, prevblock + 1, &runlength);
+                if (target == 0)
+                {
+                    vsfs_err("no free block left to copy a shared block\n");
+                    free(block);
+                    return -1;
+                }
+            }
+            int status = 0;
+            if (span < (int)fs->blocksize)
+                status = read_block(fs, (void *)block, currblock);
+            memcpy(block + blockoffset, bytes + written, span);
+            if (status == 0)
+                status = write_block(fs, (void *)block, target);
+            if (status == 0 && target != currblock &&
+                block_replace(fs, openfile, prevblock, currblock, target) == -1)
+            {
+                // a second fork, the file gets a chain of its own
+                release_block(fs, target);
+                free(block);
+                if (file_unshare(fs, openfile) == -1)
+                    return -1;
+                return file_overwrite(fs, openfile, bytes + written, n - written, offset + written);
+            }
+            if (status == -1)
+            {
+                if (target != currblock)
+                    release_block(fs, target);
+                free(block);
+                return -1;
+            }
+            currblock = target;
+        }
+        written += span;
+        prevblock = currblock;
+        currblock = file_nextblock(fs, entry, currblock);
+    }
+    free(block);
+    return 0;
+}
+
+// write n bytes at offset, which may be anywhere up to the end of the
+// file. the bytes past the end are appended.
+static int file_pwrite(struct vsfs *fs, openfiletable_entry *openfile, void *buf, int n, long offset)
+{
+    if (openfile->mode != MODE_WRITE)
+        return -1;
+    if (n < 0 || offset < 0 || (uintmax_t)offset > openfile->entry->filesize)
+        return -1;
+    uint8_t *bytes = (uint8_t *)buf;
+    int overlap = n;
+    if ((uintmax_t)offset + n > openfile->entry->filesize)
+        overlap = openfile->entry->filesize - offset;
+    if (overlap > 0 && file_overwrite(fs, openfile, bytes, overlap, offset) == -1)
+        return -1;
+    return file_extend(fs, openfile, bytes + overlap, n - overlap);
+}
+
+// cut the file down to length bytes, the blocks past it go back to the
+// free pool
+static int file_truncate(struct vsfs *fs, openfiletable_entry *openfile, uintmax_t length)
+{
+    directory_entry *entry = openfile->entry;
+    if (openfile->mode == MODE_READ || length > entry->filesize)
+        return -1;
+    if (length == entry->filesize)
+        return 0;
+    if (entry->flags & DIRENT_INLINE)
+    {
+        memset(entry->inlinedata + length, 0, entry->filesize - length);
+        entry->filesize = length;
+        mark_dirslot_dirty(fs, openfile->slot);
+        return 0;
+    }
+    // the tail buffer is read again by the next append
+    if (flush_tail(fs, openfile) == -1)
+        return -1;
+    free(openfile->tailbuf);
+    openfile->tailbuf = NULL;
+    openfile->tailblock = NO_START_BLOCK;
+
+    uint32_t keep = (length + fs->blocksize - 1) / fs->blocksize;
+    if (entry->flags & DIRENT_PACKED)
+    {
+        if (length > entry->filesize - entry->filesize % fs->blocksize)
+        {
+            // the cut is inside the packed tail
+            entry->filesize = length;
+            mark_dirslot_dirty(fs, openfile->slot);
+            return 0;
+        }
+        pthread_mutex_lock(&fs->pack.lock);
+        tailpack_drop(fs, entry->packblock);
+        pthread_mutex_unlock(&fs->pack.lock);
+        entry->flags &= ~DIRENT_PACKED;
+        entry->packblock = 0;
+        entry->tailoffset = 0;
+    }
+
+    uint32_t prevblock = NO_START_BLOCK;
+    bool forkkept = false;
+    for (uint32_t i = 0; i < keep; i++)
+    {
+        prevblock = prevblock == NO_START_BLOCK ? entry->startblock : file_nextblock(fs, entry, prevblock);
+        forkkept = forkkept || ((entry->flags & DIRENT_FORKED) && prevblock == entry->forkblock);
+    }
+    vsfs_count(fs, fathops, keep);
+    if ((entry->flags & DIRENT_FORKED) && forkkept && prevblock != entry->forkblock && block_shared(fs, prevblock))
+    {
+        // ending the chain at prevblock would take a second fork
+        if (file_unshare(fs, openfile) == -1)
+            return -1;
+        return file_truncate(fs, openfile, length);
+    }
+
+    directory_entry old = *entry; // the chain that is cut off is walked as it was
+    uint32_t currblock = prevblock == NO_START_BLOCK ? entry->startblock : file_nextblock(fs, entry, prevblock);
+    if ((entry->flags & DIRENT_FORKED) && !forkkept)
+    {
+        entry->flags &= ~DIRENT_FORKED;
+        entry->forkblock = 0;
+        entry->forknext = 0;
+    }
+    if (file_link(fs, openfile->slot, prevblock, FAT_LIST_NULL) == -1)
+        return -1;
+    while (currblock != FAT_LIST_NULL)
+    {
+        uint32_t nextblock = file_nextblock(fs, &old, currblock);
+        if (!(old.flags & DIRENT_SHARED) || !share_drop(fs, currblock))
+        {
+            fat_set(fs, currblock, FAT_LIST_NULL);
+            release_block(fs, currblock);
+        }
+        currblock = nextblock;
+    }
+    entry->filesize = length;
+    mark_dirslot_dirty(fs, openfile->slot);
+    return 0;
+}
+
+int vsfs_append(vsfs_t *fs, int fd, void *buf, int n)
+{
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    journal_begin(fs);
+    int status = file_append(fs, openfile, buf, n);
+    // the tail has to be on disk before the new size is committed
+    if (status == 0 && fs->journal.active)
+        status = flush_tail(fs, openfile);
+    journal_end(fs);
+    openfile_unlock(fs, openfile);
+    if (status == 0)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_APPEND, start);
+    return status;
+}
+
+// write the tail and the cached blocks of the file and sync them
+static int file_syncdata(struct vsfs *fs, openfiletable_entry *openfile)
+{
+    if (flush_tail(fs, openfile) == -1)
+        return -1;
+    bool packed = openfile->entry->flags & DIRENT_PACKED;
+    pthread_mutex_lock(&fs->blockcache.lock);
+    int status = cache_flushchain(fs, openfile->entry, openfile->entry->startblock);
+    if (status == 0 && packed)
+        status = cache_flushchain(fs, NULL, openfile->entry->packblock);
+    pthread_mutex_unlock(&fs->blockcache.lock);
+    if (status == -1)
+        return -1;
+    // without a mapping dev_syncchain syncs the whole vdisk anyway
+    if (packed && fs->map != NULL && dev_syncchain(fs, NULL, openfile->entry->packblock) == -1)
+        return -1;
+    return dev_syncchain(fs, openfile->entry, openfile->entry->startblock);
+}
+
+// write n bytes at offset through a MODE_WRITE descriptor
+int vsfs_pwrite(vsfs_t *fs, int fd, void *buf, int n, long offset)
+{
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    journal_begin(fs);
+    int status = file_pwrite(fs, openfile, buf, n, offset);
+    if (status == 0 && fs->journal.active)
+        status = flush_tail(fs, openfile);
+    journal_end(fs);
+    openfile_unlock(fs, openfile);
+    if (status == 0)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_PWRITE, start);
+    return status;
+}
+
+int vsfs_truncate(vsfs_t *fs, int fd, long length)
+{
+    if (length < 0)
+        return -1;
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    journal_begin(fs);
+    int status = file_truncate(fs, openfile, length);
+    journal_end(fs);
+    openfile_unlock(fs, openfile);
+    if (status == 0)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_TRUNCATE, start);
+    return status;
+}
+
+int vsfs_fsync(vsfs_t *fs, int fd, int level)
+{
+    if (level != VSFS_SYNC_DATA && level != VSFS_SYNC_METADATA && level != VSFS_SYNC_BARRIER)
+        return -1;
+    vsfs_clock(start);
+    openfiletable_entry *openfile = openfile_lock(fs, fd);
+    if (openfile == NULL)
+        return -1;
+    int status = file_syncdata(fs, openfile);
+    // the data of an inline file is in its directory entry
+    if (level == VSFS_SYNC_DATA && (openfile->entry->flags & DIRENT_INLINE))
+        level = VSFS_SYNC_METADATA;
+    // the descriptor may be closed and reused once it is unlocked
+    int32_t slot = openfile->slot;
+    openfile_unlock(fs, openfile);
+    if (status == 0 && level == VSFS_SYNC_BARRIER)
+    {
+        pthread_rwlock_wrlock(&fs->lock);
+        status = sync_disk(fs);
+        pthread_rwlock_unlock(&fs->lock);
+    }
+    else if (status == 0 && level == VSFS_SYNC_METADATA)
+    {
+        // a journaled mount has committed the metadata of the file
+        // already, this waits for a commit still in flight
+        if (fs->journal.active)
+            status = journal_commit(fs);
+        else
+        {
+            // if the file went away meanwhile this flushes whatever
+            // holds the slot now, which does no harm
+            pthread_rwlock_wrlock(&fs->lock);
+            status = flush_filemetadata(fs, slot);
+            if (status == 0)
+                status = dev_sync(fs);
+            pthread_rwlock_unlock(&fs->lock);
+        }
+    }
+    vsfs_latency(fs, VSFS_CALL_FSYNC, start);
+    return status;
+}
+
+static int delete_file(struct vsfs *fs, char *filename)
+{
+    int32_t slot = dirindex_lookup(fs, filename);
+    if (slot == -1)
+        return -1;
+    // an open descriptor would go on using the slot and the blocks
+    for (int i = 0; i < 128; i++)
+    {
+        if (!fs->openfiletable[i].free && fs->openfiletable[i].slot == slot)
+        {
+            vsfs_err("%s is still open\n", filename);
+            return -1;
+        }
+    }
+    directory_entry *entry = dirent(fs, slot);
+
+    directory_entry removed = *entry; // its chain is walked after the entry is cleared
+    if (entry->flags & DIRENT_PACKED)
+    {
+        pthread_mutex_lock(&fs->pack.lock);
+        tailpack_drop(fs, entry->packblock);
+        pthread_mutex_unlock(&fs->pack.lock);
+    }
+    // delete file entry from the directory
+    dirindex_remove(fs, filename);
+    fs->dirindex.freeslots[fs->dirindex.freecount++] = slot;
+    entry->filesize = 0;
+    for (int i = 0; i < 30; i++)
+    {
+        entry->filename[i] = '\0';
+    }
+    entry->isoccupied = false;
+    entry->startblock = NO_START_BLOCK;
+    entry->flags = 0;
+    memset(entry->inlinedata, 0, INLINE_BYTES);
+    mark_dirslot_dirty(fs, slot);
+    dirindex_compact(fs);
+
+    vsfs_info("vsdelete: file entry -> isoccupied: %d, filesize: %ld, startblock: %u, filename: %s\n",
+              entry->isoccupied, entry->filesize, entry->startblock, entry->filename);
+
+    uint8_t *emptyblock = new_datablock(fs);
+    uint32_t currblock = removed.startblock;
+    while (currblock != FAT_LIST_NULL)
+    {
+        uint32_t nextblock = file_nextblock(fs, &removed, currblock);
+        if ((removed.flags & DIRENT_SHARED) && share_drop(fs, currblock))
+        {
+            // still held by a clone, its FAT entry stays
+            currblock = nextblock;
+            continue;
+        }
+        int status = write_block(fs, (void *)emptyblock, currblock);
+        if (status != 0)
+        {
+            vsfs_err("failed to write empty block");
+            return -1;
+        }
+        fat_set(fs, currblock, FAT_LIST_NULL);
+        release_block(fs, currblock);
+        currblock = nextblock;
+    }
+
+    vsfs_info("file deleted %s", filename);
+    print_fattable(fs);
+    free(emptyblock);
+    return 0;
+}
+
+int vsfs_delete(vsfs_t *fs, char *filename)
+{
+    if (fs == NULL)
+        return -1;
+    vsfs_clock(start);
+    pthread_rwlock_wrlock(&fs->lock);
+    journal_begin(fs);
+    int status = delete_file(fs, filename);
+    journal_end(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    if (status == 0)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_DELETE, start);
+    return status;
+}
+
+// make target a copy of source that shares its blocks, see Shared blocks
+static int clone_file(struct vsfs *fs, char *source, char *target)
+{
+    if (fs->geometry.version == 1)
+    {
+        vsfs_err("vsclone needs a v2 disk\n");
+        return -1;
+    }
+    int32_t sourceslot = dirindex_lookup(fs, source);
+    if (sourceslot == -1)
+        return -1;
+    // the buffered tail of an append descriptor has to be in its block
+    for (int i = 0; i < 128; i++)
+    {
+        openfiletable_entry *openfile = &fs->openfiletable[i];
+        if (!openfile->free && openfile->slot == sourceslot && flush_tail(fs, openfile) == -1)
+            return -1;
+    }
+    if (create_file(fs, target) == -1)
+        return -1;
+    int32_t targetslot = dirindex_lookup(fs, target);
+    directory_entry *from = dirent(fs, sourceslot);
+    directory_entry *to = dirent(fs, targetslot);
+
+    if (from->flags & DIRENT_PACKED)
+    {
+        pthread_mutex_lock(&fs->pack.lock);
+        int count = refcount_add(&fs->pack.tails, from->packblock, 1);
+        pthread_mutex_unlock(&fs->pack.lock);
+        if (count == -1)
+        {
+            delete_file(fs, target);
+            return -1;
+        }
+    }
+    uint32_t block = from->startblock;
+    for (; block != FAT_LIST_NULL; block = file_nextblock(fs, from, block))
+    {
+        if (share_add(fs, block) == -1)
+            break;
+    }
+    if (block != FAT_LIST_NULL)
+    {
+        for (uint32_t b = from->startblock; b != block; b = file_nextblock(fs, from, b))
+            share_drop(fs, b);
+        if (from->flags & DIRENT_PACKED)
+        {
+            pthread_mutex_lock(&fs->pack.lock);
+            tailpack_drop(fs, from->packblock);
+            pthread_mutex_unlock(&fs->pack.lock);
+        }
+        delete_file(fs, target);
+        return -1;
+    }
+
+    to->filesize = from->filesize;
+    to->startblock = from->startblock;
+    to->flags = from->flags;
+    to->tailoffset = from->tailoffset;
+    memcpy(to->inlinedata, from->inlinedata, INLINE_BYTES);
+    if (from->startblock != NO_START_BLOCK)
+    {
+        from->flags |= DIRENT_SHARED;
+        to->flags |= DIRENT_SHARED;
+    }
+    mark_dirslot_dirty(fs, sourceslot);
+    mark_dirslot_dirty(fs, targetslot);
+    vsfs_info("cloned %s into %s\n", source, target);
+    return 0;
+}
+
+int vsfs_clone(vsfs_t *fs, char *source, char *target)
+{
+    if (fs == NULL)
+        return -1;
+    vsfs_clock(start);
+    pthread_rwlock_wrlock(&fs->lock);
+    journal_begin(fs);
+    int status = clone_file(fs, source, target);
+    journal_end(fs);
+    pthread_rwlock_unlock(&fs->lock);
+    if (status == 0)
+        status = journal_commit(fs);
+    vsfs_latency(fs, VSFS_CALL_CLONE, start);
+    return status;
+}
+
+int vsfs_read_async(vsfs_t *fs, int fd, void *buf, int n, vsfs_callback callback, void *arg)
+{
+    return async_submit(fs, false, fd, buf, n, callback, arg);
+}
+
+int vsfs_append_async(vsfs_t *fs, int fd, void *buf, int n, vsfs_callback callback, void *arg)
+{
+    return async_submit(fs, true, fd, buf, n, callback, arg);
+}
+
+int vsfs_poll(vsfs_t *fs, struct vsfs_completion *completions, int max)
+{
+    if (fs == NULL || completions == NULL || max < 0)
+        return -1;
+    pthread_mutex_lock(&fs->async.lock);
+    int count = 0;
+    while (count < max && fs->async.donehead != NULL)
+    {
+        async_request *request = fs->async.donehead;
+        fs->async.donehead = request->next;
+        completions[count].fd = request->fd;
+        completions[count].status = request->status;
+        completions[count].arg = request->arg;
+        free(request);
+        count++;
+    }
+    if (fs->async.donehead == NULL)
+    {
+        // nothing left, reset the eventfd counter
+        fs->async.donetail = NULL;
+        uint64_t pending;
+        if (fs->async.eventfd != -1 && read(fs->async.eventfd, &pending, sizeof(pending)) == -1 && errno != EAGAIN)
+            vsfs_err("failed to reset completion eventfd\n");
+    }
+    pthread_mutex_unlock(&fs->async.lock);
+    return count;
+}
+
+int vsfs_completion_fd(vsfs_t *fs)
+{
+    if (fs == NULL || async_start(fs) == -1)
+        return -1;
+    return fs->async.eventfd;
+}
+
+/**********************************************************************
+  Default mount
+  the original interface works on one vdisk per process, mounted with
+  vsmount. it is kept as a thin layer over the handle based one.
+***********************************************************************/
+static vsfs_t *vs_default = NULL;
+
+int vsmount_ex(char *vdiskname, int flags)
+{
+    if (vs_default != NULL)
+    {
+        vsfs_err("a vdisk is already mounted\n");
+        return -1;
+    }
+    vs_default = vsfs_mount(vdiskname, flags);
+    if (vs_default == NULL)
+        return -1;
+    return (0);
+}
+
+int vsmount(char *vdiskname)
+{
+    return vsmount_ex(vdiskname, 0);
+}
+
+int vssync()
+{
+    return vsfs_sync(vs_default);
+}
+
+int vscache_stats(struct vsfs_cachestats *stats)
+{
+    return vsfs_cache_stats(vs_default, stats);
+}
+
+int vsget_stats(struct vsfs_stats *stats)
+{
+    return vsfs_get_stats(vs_default, stats);
+}
+
+int vsumount()
+{
+    if (vsfs_umount(vs_default) == -1)
+        return -1;
+    vs_default = NULL;
+    return (0);
+}
+
+int vscreate(char *filename)
+{
+    return vsfs_create(vs_default, filename);
+}
+
+int vsopen(char *file, int mode)
+{
+    return vsfs_open(vs_default, file, mode);
+}
+
+int vsclose(int fd)
+{
+    return vsfs_close(vs_default, fd);
+}
+
+long vssize(int fd)
+{
+    return vsfs_size(vs_default, fd);
+}
+
+int vsread(int fd, void *buf, int n)
+{
+    return vsfs_read(vs_default, fd, buf, n);
+}
+
+long vsseek(int fd, long offset, int whence)
+{
+    return vsfs_seek(vs_default, fd, offset, whence);
+}
+
+int vspread(int fd, void *buf, int n, long offset)
+{
+    return vsfs_pread(vs_default, fd, buf, n, offset);
+}
+
+int vsappend(int fd, void *buf, int n)
+{
+    return vsfs_append(vs_default, fd, buf, n);
+}
+
+int vsclone(char *source, char *target)
+{
+    return vsfs_clone(vs_default, source, target);
+}
+
+int vspwrite(int fd, void *buf, int n, long offset)
+{
+    return vsfs_pwrite(vs_default, fd, buf, n, offset);
+}
+
+int vstruncate(int fd, long length)
+{
+    return vsfs_truncate(vs_default, fd, length);
+}
+
+int vsdelete(char *filename)
+{
+    return vsfs_delete(vs_default, filename);
+}
+
+int vsread_async(int fd, void *buf, int n, vsfs_callback callback, void *arg)
+{
+    return vsfs_read_async(vs_default, fd, buf, n, callback, arg);
+}
+
+int vsappend_async(int fd, void *buf, int n, vsfs_callback callback, void *arg)
+{
+    return vsfs_append_async(vs_default, fd, buf, n, callback, arg);
+}
+
+int vspoll(struct vsfs_completion *completions, int max)
+{
+    return vsfs_poll(vs_default, completions, max);
+}
+
+int vscompletion_fd()
+{
+    return vsfs_completion_fd(vs_default);
+}
+
+int vsfsync(int fd, int level)
+{
+    return vsfs_fsync(vs_default, fd, level);
+}
@@ -1,15 +1,100 @@
 
 
-// Do not change this file //
+// vsfs interface. existing calls keep their signatures and behaviour,
+// additions go after the calls they extend
 
 #define MODE_READ 0
 #define MODE_APPEND 1
-#define BLOCKSIZE 2048 // bytes
+#define MODE_WRITE 2 // vspwrite anywhere in the file, vsappend is refused
+#define BLOCKSIZE 2048 // bytes, block size of disks made by vsformat
+
+// block sizes vsformat_ex takes, powers of two in between
+#define VSFS_MIN_BLOCKSIZE 512
+#define VSFS_MAX_BLOCKSIZE 65536
+
+// flags for vsformat_ex
+#define VSFS_FORMAT_SPARSE 0x1 // leave the data blocks as holes, constant time
+#define VSFS_FORMAT_JOURNAL 0x2 // metadata journal, vscreate, vsappend and vsdelete
+                               // are durable when they return
+
+// flags for vsmount_ex
+#define VSFS_MOUNT_MMAP 0x1 // map the whole vdisk, durability via msync
+
+#define VSFS_CACHE_DEFAULT_BLOCKS 64 // block cache size used by vsmount
+
+struct vsfs_cachestats
+{
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+    unsigned long readaheads; // blocks read ahead of sequential readers
+};
+
+// calls timed by vsfs_get_stats
+enum vsfs_call
+{
+    VSFS_CALL_MOUNT,
+    VSFS_CALL_SYNC,
+    VSFS_CALL_CREATE,
+    VSFS_CALL_OPEN,
+    VSFS_CALL_CLOSE,
+    VSFS_CALL_SIZE,
+    VSFS_CALL_READ,
+    VSFS_CALL_SEEK,
+    VSFS_CALL_PREAD,
+    VSFS_CALL_APPEND,
+    VSFS_CALL_FSYNC,
+    VSFS_CALL_DELETE,
+    VSFS_CALL_CLONE,
+    VSFS_CALL_PWRITE,
+    VSFS_CALL_TRUNCATE,
+    VSFS_CALLS
+};
+
+// latency bucket i counts the calls that took 2^i up to 2^(i+1) - 1
+// nanoseconds, the last bucket everything longer
+#define VSFS_LATENCY_BUCKETS 40
+
+// counters of one mount since vsmount
+struct vsfs_stats
+{
+    unsigned long blockreads;   // blocks read from the vdisk
+    unsigned long blockwrites;  // blocks written to the vdisk
+    unsigned long bytesread;
+    unsigned long byteswritten;
+    unsigned long readcalls;    // preadv calls on the vdisk
+    unsigned long writecalls;   // pwritev calls on the vdisk
+    unsigned long synccalls;    // fsync, fdatasync and msync calls
+    unsigned long advisecalls;  // posix_fadvise and madvise calls
+    unsigned long fathops;      // FAT entries followed to find a block of a file
+    unsigned long allocations;  // calls to the free block allocator
+    unsigned long bitsscanned;  // free map bits looked at by the allocator
+    unsigned long dirprobes;    // directory index slots looked at
+    unsigned long calls[VSFS_CALLS];
+    unsigned long latencyns[VSFS_CALLS]; // total time spent in each call
+    unsigned long latency[VSFS_CALLS][VSFS_LATENCY_BUCKETS];
+};
 
 int vsformat (char *vdiskname, unsigned int m);
 
+// vsformat with blocksize bytes per block instead of BLOCKSIZE
+int vsformat_ex (char *vdiskname, unsigned int m, unsigned int blocksize, int flags);
+
 int vsmount (char *vdiskname);
 
+int vsmount_ex (char *vdiskname, int flags);
+
+int vssync ();
+
+// block cache size in blocks for the next vsmount, 0 disables the cache
+int vscache_setsize (int blockcount);
+
+int vscache_stats (struct vsfs_cachestats *stats);
+
+// -1 when vsfs was built with NO_STATS
+int vsget_stats (struct vsfs_stats *stats);
+
 int vsumount ();
 
 int vscreate(char *filename);
@@ -18,12 +103,113 @@ int vsopen(char *filename, int mode);
 
 int vsclose(int fd);
 
-int vssize (int fd);
+long vssize (int fd);
 
 int vsread(int fd, void *buf, int n);
 
+// whence is SEEK_SET, SEEK_CUR or SEEK_END
+long vsseek(int fd, long offset, int whence);
+
+int vspread(int fd, void *buf, int n, long offset);
+
 int vsappend(int fd, void *buf, int n);
 
+// MODE_WRITE, offset is at most the file size and the bytes past the
+// end are appended. only the blocks written to change.
+int vspwrite(int fd, void *buf, int n, long offset);
+
+// shorten the file to length bytes, not on MODE_READ descriptors
+int vstruncate(int fd, long length);
+
+// durability levels for vsfsync
+#define VSFS_SYNC_DATA 0     // the data blocks of the file
+#define VSFS_SYNC_METADATA 1 // its data and the metadata describing it
+#define VSFS_SYNC_BARRIER 2  // everything, like vssync
+
+int vsfsync(int fd, int level);
+
 int vsdelete(char *filename);
 
+// target becomes a copy of source that shares its blocks until either
+// file is written to, v2 disks only. no data block is copied, but every
+// block of source is counted in memory, so the time grows with its size
+int vsclone(char *source, char *target);
+
+
+// handle based interface, any number of vdisks per process. calls on
+// one mount may come from several threads: operations on different
+// open files run in parallel, vsfs_create, vsfs_delete, vsfs_clone and
+// vsfs_sync wait for the others. the functions above work on one default mount.
+typedef struct vsfs vsfs_t;
+
+// NULL on failure
+vsfs_t *vsfs_mount (char *vdiskname, int flags);
+
+int vsfs_sync (vsfs_t *fs);
+
+int vsfs_cache_stats (vsfs_t *fs, struct vsfs_cachestats *stats);
+
+int vsfs_get_stats (vsfs_t *fs, struct vsfs_stats *stats);
+
+// fs is gone unless -1 is returned
+int vsfs_umount (vsfs_t *fs);
+
+int vsfs_create (vsfs_t *fs, char *filename);
+
+int vsfs_open (vsfs_t *fs, char *filename, int mode);
+
+int vsfs_close (vsfs_t *fs, int fd);
+
+long vsfs_size (vsfs_t *fs, int fd);
+
+int vsfs_read (vsfs_t *fs, int fd, void *buf, int n);
+
+long vsfs_seek (vsfs_t *fs, int fd, long offset, int whence);
+
+int vsfs_pread (vsfs_t *fs, int fd, void *buf, int n, long offset);
+
+int vsfs_append (vsfs_t *fs, int fd, void *buf, int n);
+
+int vsfs_pwrite (vsfs_t *fs, int fd, void *buf, int n, long offset);
+
+int vsfs_truncate (vsfs_t *fs, int fd, long length);
+
+int vsfs_fsync (vsfs_t *fs, int fd, int level);
+
+int vsfs_delete (vsfs_t *fs, char *filename);
+
+int vsfs_clone (vsfs_t *fs, char *source, char *target);
+
+// asynchronous interface. a request runs on a worker thread of the
+// mount, requests on one fd complete in the order they were submitted.
+// buf has to stay valid until completion. status is what the
+// synchronous call would have returned.
+typedef void (*vsfs_callback) (void *arg, int fd, int status);
+
+// a completed request that was submitted without a callback
+struct vsfs_completion
+{
+    int fd;
+    int status;
+    void *arg;
+};
+
+// 0 once queued. callback runs on the worker thread, pass NULL to have
+// the completion queued for vsfs_poll instead
+int vsfs_read_async (vsfs_t *fs, int fd, void *buf, int n, vsfs_callback callback, void *arg);
+
+int vsfs_append_async (vsfs_t *fs, int fd, void *buf, int n, vsfs_callback callback, void *arg);
+
+// take up to max queued completions without blocking, returns how many
+int vsfs_poll (vsfs_t *fs, struct vsfs_completion *completions, int max);
+
+// file descriptor that polls readable while completions are queued
+int vsfs_completion_fd (vsfs_t *fs);
+
+int vsread_async (int fd, void *buf, int n, vsfs_callback callback, void *arg);
+
+int vsappend_async (int fd, void *buf, int n, vsfs_callback callback, void *arg);
+
+int vspoll (struct vsfs_completion *completions, int max);
 
+int vscompletion_fd ();
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "vsfs.h"
+
+// workload benchmarks for vsfs. every workload reports its throughput,
+// latency percentiles, its read and write syscalls and the vdisk calls
+// vsfs made, as JSON on stdout (or the -o file), so that runs of two
+// versions can be diffed.
+
+typedef struct bench_options
+{
+    char vdiskname[200];
+    unsigned int m;       // vdisk size is 2^m bytes
+    int iterations;       // operations per workload
+    int smallsize;        // bytes per small append
+    int largesize;        // bytes per large append
+    int readsize;         // bytes per read
+    int largeiterations;  // large appends, their file is read by the read workloads
+    unsigned int seed;
+} bench_options;
+
+// counters of /proc/self/io and of vsget_stats. syscr and syscw count
+// every read and write of the process, the bench's own reads of
+// /proc/self/io included. the vdisk calls cover fsync, fdatasync, msync
+// and the advice calls too, but only while a vsfs is mounted
+typedef struct io_counters
+{
+    unsigned long long rchar;
+    unsigned long long wchar;
+    unsigned long long syscr;
+    unsigned long long syscw;
+    bool mounted;
+    unsigned long long readcalls;
+    unsigned long long writecalls;
+    unsigned long long synccalls;
+    unsigned long long advisecalls;
+} io_counters;
+
+typedef struct bench_result
+{
+    const char *name;
+    int iterations;
+    unsigned long long bytes;
+    uint64_t *latencies; // ns, one per operation
+    double seconds;
+    io_counters before;
+    io_counters io; // calls and bytes of the timed operations
+} bench_result;
+
+static void read_io(io_counters *counters)
+{
+    memset(counters, 0, sizeof(*counters));
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL)
+        return;
+    char name[32];
+    unsigned long long value;
+    while (fscanf(file, "%31[^:]: %llu\n", name, &value) == 2)
+    {
+        if (strcmp(name, "rchar") == 0)
+            counters->rchar = value;
+        else if (strcmp(name, "wchar") == 0)
+            counters->wchar = value;
+        else if (strcmp(name, "syscr") == 0)
+            counters->syscr = value;
+        else if (strcmp(name, "syscw") == 0)
+            counters->syscw = value;
+    }
+    fclose(file);
+    struct vsfs_stats stats;
+    if (vsget_stats(&stats) == 0)
+    {
+        counters->mounted = true;
+        counters->readcalls = stats.readcalls;
+        counters->writecalls = stats.writecalls;
+        counters->synccalls = stats.synccalls;
+        counters->advisecalls = stats.advisecalls;
+    }
+}
+
+// adds what happened since before to the result
+static void add_io(bench_result *result, io_counters *before)
+{
+    io_counters after;
+    read_io(&after);
+    result->io.rchar += after.rchar - before->rchar;
+    result->io.wchar += after.wchar - before->wchar;
+    result->io.syscr += after.syscr - before->syscr;
+    result->io.syscw += after.syscw - before->syscw;
+    // the stats of a mount start at zero and go away with vsumount
+    if (!after.mounted)
+        return;
+    io_counters from = before->mounted ? *before : (io_counters){0};
+    result->io.mounted = true;
+    result->io.readcalls += after.readcalls - from.readcalls;
+    result->io.writecalls += after.writecalls - from.writecalls;
+    result->io.synccalls += after.synccalls - from.synccalls;
+    result->io.advisecalls += after.advisecalls - from.advisecalls;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void result_begin(bench_result *result, const char *name, int iterations)
+{
+    memset(result, 0, sizeof(*result));
+    result->name = name;
+    result->iterations = iterations;
+    result->latencies = (uint64_t *)calloc(iterations > 0 ? iterations : 1, sizeof(uint64_t));
+    if (result->latencies == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    read_io(&result->before);
+}
+
+static void result_end(bench_result *result)
+{
+    add_io(result, &result->before);
+    for (int i = 0; i < result->iterations; i++)
+        result->seconds += result->latencies[i] / 1e9;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// latency below which permille of the operations finished
+static uint64_t percentile(bench_result *result, int permille)
+{
+    if (result->iterations == 0)
+        return 0;
+    int index = (int)(((long long)result->iterations * permille + 999) / 1000) - 1;
+    if (index < 0)
+        index = 0;
+    return result->latencies[index];
+}
+
+static void result_print(FILE *out, bench_result *result, bool last)
+{
+    qsort(result->latencies, result->iterations, sizeof(uint64_t), compare_latency);
+    double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": \"%s\",\n", result->name);
+    fprintf(out, "      \"iterations\": %d,\n", result->iterations);
+    fprintf(out, "      \"bytes\": %llu,\n", result->bytes);
+    fprintf(out, "      \"seconds\": %.6f,\n", result->seconds);
+    fprintf(out, "      \"ops_per_sec\": %.1f,\n", result->iterations / seconds);
+    fprintf(out, "      \"mb_per_sec\": %.3f,\n", result->bytes / seconds / (1024.0 * 1024.0));
+    fprintf(out, "      \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu},\n",
+            (unsigned long long)percentile(result, 500), (unsigned long long)percentile(result, 990),
+            (unsigned long long)percentile(result, 999), (unsigned long long)percentile(result, 1000));
+    fprintf(out, "      \"rw_syscalls\": {\"read\": %llu, \"write\": %llu},\n",
+            result->io.syscr, result->io.syscw);
+    // null when no operation ended with vsfs mounted, as for format and umount
+    if (result->io.mounted)
+        fprintf(out, "      \"vdisk_calls\": {\"read\": %llu, \"write\": %llu, \"sync\": %llu, \"advise\": %llu},\n",
+                result->io.readcalls, result->io.writecalls, result->io.synccalls, result->io.advisecalls);
+    else
+        fprintf(out, "      \"vdisk_calls\": null,\n");
+    fprintf(out, "      \"io_bytes\": {\"read\": %llu, \"write\": %llu}\n",
+            result->io.rchar, result->io.wchar);
+    fprintf(out, "    }%s\n", last ? "" : ",");
+    free(result->latencies);
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "benchmark failed: %s\n", what);
+    exit(1);
+}
+
+// vsformat, vsmount and vsumount, each timed on its own
+static void bench_format(bench_options *options, bench_result *results)
+{
+    int n = options->iterations < 20 ? options->iterations : 20;
+    result_begin(&results[0], "format", n);
+    result_begin(&results[1], "mount", n);
+    result_begin(&results[2], "umount", n);
+    io_counters counters;
+    for (int i = 0; i < n; i++)
+    {
+        read_io(&counters);
+        uint64_t start = now_ns();
+        if (vsformat(options->vdiskname, options->m) != 0)
+            fail("vsformat");
+        results[0].latencies[i] = now_ns() - start;
+        add_io(&results[0], &counters);
+
+        read_io(&counters);
+        start = now_ns();
+        if (vsmount(options->vdiskname) != 0)
+            fail("vsmount");
+        results[1].latencies[i] = now_ns() - start;
+        add_io(&results[1], &counters);
+
+        read_io(&counters);
+        start = now_ns();
+        if (vsumount() != 0)
+            fail("vsumount");
+        results[2].latencies[i] = now_ns() - start;
+        add_io(&results[2], &counters);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < n; j++)
+            results[i].seconds += results[i].latencies[j] / 1e9;
+    }
+}
+
+static void bench_append(bench_result *result, const char *name, const char *filename, int size, int n)
+{
+    char *buffer = (char *)malloc(size);
+    if (buffer == NULL)
+        fail("out of memory");
+    memset(buffer, 'v', size);
+    if (vscreate((char *)filename) != 0)
+        fail("vscreate");
+    int fd = vsopen((char *)filename, MODE_APPEND);
+    result_begin(result, name, n);
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t start = now_ns();
+        if (vsappend(fd, buffer, size) != 0)
+            fail("vsappend");
+        result->latencies[i] = now_ns() - start;
+        result->bytes += size;
+    }
+    uint64_t start = now_ns();
+    vsclose(fd);
+    result->latencies[n - 1] += now_ns() - start; // the last tail goes out on close
+    result_end(result);
+    free(buffer);
+}
+
+static void bench_seqread(bench_options *options, bench_result *result, const char *filename)
+{
+    char *buffer = (char *)malloc(options->readsize);
+    if (buffer == NULL)
+        fail("out of memory");
+    int fd = vsopen((char *)filename, MODE_READ);
+    long size = vssize(fd);
+    int n = (size + options->readsize - 1) / options->readsize;
+    result_begin(result, "seq_read", n);
+    for (int i = 0; i < n; i++)
+    {
+        int length = size - (long)i * options->readsize < options->readsize ? size - (long)i * options->readsize : options->readsize;
+        uint64_t start = now_ns();
+        if (vsread(fd, buffer, length) != 0)
+            fail("vsread");
+        result->latencies[i] = now_ns() - start;
+        result->bytes += length;
+    }
+    result_end(result);
+    vsclose(fd);
+    free(buffer);
+}
+
+static void bench_randread(bench_options *options, bench_result *result, const char *filename)
+{
+    char *buffer = (char *)malloc(options->readsize);
+    if (buffer == NULL)
+        fail("out of memory");
+    int fd = vsopen((char *)filename, MODE_READ);
+    long size = vssize(fd);
+    if (size < options->readsize)
+        fail("file smaller than one read");
+    srand(options->seed);
+    result_begin(result, "random_read", options->iterations);
+    for (int i = 0; i < options->iterations; i++)
+    {
+        long offset = rand() % (size - options->readsize + 1);
+        uint64_t start = now_ns();
+        if (vspread(fd, buffer, options->readsize, offset) != 0)
+            fail("vspread");
+        result->latencies[i] = now_ns() - start;
+        result->bytes += options->readsize;
+    }
+    result_end(result);
+    vsclose(fd);
+    free(buffer);
+}
+
+// vscreate, vsopen, one small append, vsclose and vsdelete per operation
+static void bench_churn(bench_options *options, bench_result *result)
+{
+    char filename[32];
+    char byte = 'c';
+    result_begin(result, "churn", options->iterations);
+    for (int i = 0; i < options->iterations; i++)
+    {
+        snprintf(filename, sizeof(filename), "churn%d", i % 1000);
+        uint64_t start = now_ns();
+        if (vscreate(filename) != 0)
+            fail("vscreate");
+        int fd = vsopen(filename, MODE_APPEND);
+        if (fd == -1 || vsappend(fd, &byte, 1) != 0 || vsclose(fd) != 0 || vsdelete(filename) != 0)
+            fail("churn");
+        result->latencies[i] = now_ns() - start;
+        result->bytes++;
+    }
+    result_end(result);
+}
+
+static bool wanted(int argc, char **argv, const char *name)
+{
+    if (argc == 0)
+        return true;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: vsfs_bench [-d vdiskname] [-m order] [-n iterations] [-s smallsize]\n"
+                    "                  [-l largesize] [-L largeiterations] [-r readsize] [-S seed]\n"
+                    "                  [-o output.json] [workload ...]\n"
+                    "workloads: format small_append large_append seq_read random_read churn\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    bench_options options;
+    strcpy(options.vdiskname, "bench.vdisk");
+    options.m = 26;
+    options.iterations = 10000;
+    options.smallsize = 1;
+    options.largesize = 256 * 1024;
+    options.largeiterations = 64;
+    options.readsize = 4096;
+    options.seed = 1;
+    char *output = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:m:n:s:l:L:r:S:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            snprintf(options.vdiskname, sizeof(options.vdiskname), "%s", optarg);
+            break;
+        case 'm':
+            options.m = atoi(optarg);
+            break;
+        case 'n':
+            options.iterations = atoi(optarg);
+            break;
+        case 's':
+            options.smallsize = atoi(optarg);
+            break;
+        case 'l':
+            options.largesize = atoi(optarg);
+            break;
+        case 'L':
+            options.largeiterations = atoi(optarg);
+            break;
+        case 'r':
+            options.readsize = atoi(optarg);
+            break;
+        case 'S':
+            options.seed = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (options.iterations <= 0 || options.smallsize <= 0 || options.largesize <= 0 ||
+        options.largeiterations <= 0 || options.readsize <= 0)
+        usage();
+    argc -= optind;
+    argv += optind;
+    const char *workloads[] = {"format", "small_append", "large_append", "seq_read", "random_read", "churn"};
+    for (int i = 0; i < argc; i++)
+    {
+        int j = 0;
+        while (j < 6 && strcmp(argv[i], workloads[j]) != 0)
+            j++;
+        if (j == 6)
+            usage();
+    }
+
+    bench_result results[8];
+    int count = 0;
+    if (wanted(argc, argv, "format"))
+    {
+        bench_format(&options, results + count);
+        count += 3;
+    }
+
+    if (vsformat(options.vdiskname, options.m) != 0 || vsmount(options.vdiskname) != 0)
+        fail("could not set up the vdisk");
+    if (wanted(argc, argv, "small_append"))
+        bench_append(results + count++, "small_append", "small.bin", options.smallsize, options.iterations);
+    // the read workloads read the large file
+    bool reads = wanted(argc, argv, "seq_read") || wanted(argc, argv, "random_read");
+    if (wanted(argc, argv, "large_append"))
+        bench_append(results + count++, "large_append", "large.bin", options.largesize, options.largeiterations);
+    else if (reads)
+    {
+        bench_result setup;
+        bench_append(&setup, "setup", "large.bin", options.largesize, options.largeiterations);
+        free(setup.latencies);
+    }
+    if (wanted(argc, argv, "seq_read"))
+        bench_seqread(&options, results + count++, "large.bin");
+    if (wanted(argc, argv, "random_read"))
+        bench_randread(&options, results + count++, "large.bin");
+    if (wanted(argc, argv, "churn"))
+        bench_churn(&options, results + count++);
+    if (vsumount() != 0)
+        fail("vsumount");
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+        fail("could not open the output file");
+    fprintf(out, "{\n");
+    fprintf(out, "  \"vdisk\": {\"m\": %u, \"blocksize\": %d},\n", options.m, BLOCKSIZE);
+    fprintf(out, "  \"workloads\": [\n");
+    for (int i = 0; i < count; i++)
+        result_print(out, &results[i], i + 1 == count);
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
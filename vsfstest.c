@@ -1,9 +1,16 @@
+#define _GNU_SOURCE // memmem
 #include <criterion/criterion.h>
 #include <criterion/new/assert.h>
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "../src/vsfs.h"
 
 char *vdiskname;
@@ -31,4 +38,1347 @@ Test(vsfs, vsformat, .disabled = false)
 Test(vsfs, vsmount, .disabled = false)
 {
   int result = vsmount(vdiskname);
-}
\ No newline at end of file
+}
+Test(vsfs, vsmount_mmap, .disabled = false)
+{
+  char data[100];
+  char readback[100];
+  memset(data, 'm', sizeof(data));
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount_ex(vdiskname, VSFS_MOUNT_MMAP), 0));
+  cr_assert(eq(int, vscreate("mapped.bin"), 0));
+  int fd = vsopen("mapped.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, sizeof(data)), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+
+  // the data must have reached the file, not just the mapping
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("mapped.bin", MODE_READ);
+  cr_assert(eq(int, vssize(fd), sizeof(data)));
+  cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  vsumount();
+}
+
+Test(vsfs, vsread_cursor, .disabled = false)
+{
+  char data[5000];
+  char readback[5000];
+  for (int i = 0; i < sizeof(data); i++)
+    data[i] = (char)(i % 251);
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("cursor.bin"), 0));
+  int fd = vsopen("cursor.bin", MODE_APPEND);
+  for (int i = 0; i < sizeof(data); i += 8)
+    cr_assert(eq(int, vsappend(fd, data + i, 8), 0));
+  vsclose(fd);
+
+  // successive reads continue where the previous one stopped
+  fd = vsopen("cursor.bin", MODE_READ);
+  for (int i = 0; i < sizeof(readback); i++)
+    cr_assert(eq(int, vsread(fd, readback + i, 1), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  vsumount();
+}
+
+Test(vsfs, vsappend_tail_buffer, .disabled = false)
+{
+  char data[3000];
+  char readback[3000];
+  for (int i = 0; i < sizeof(data); i++)
+    data[i] = (char)(i % 127);
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("tail.bin"), 0));
+  int fd = vsopen("tail.bin", MODE_APPEND);
+  for (int i = 0; i < 1000; i++)
+    cr_assert(eq(int, vsappend(fd, data + i, 1), 0));
+  vsclose(fd);
+  // reopen and keep appending into the partially filled tail block,
+  // leaving the descriptor open so that vsumount has to flush it
+  fd = vsopen("tail.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data + 1000, 2000), 0));
+  cr_assert(eq(int, vsumount(), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("tail.bin", MODE_READ);
+  cr_assert(eq(int, vssize(fd), sizeof(data)));
+  cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  vsumount();
+}
+
+Test(vsfs, vscache_stats, .disabled = false)
+{
+  char data[4096];
+  char readback[4096];
+  struct vsfs_cachestats stats;
+  memset(data, 'c', sizeof(data));
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vscache_setsize(4), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("cached.bin"), 0));
+  int fd = vsopen("cached.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, sizeof(data)), 0));
+  vsclose(fd);
+
+  // the appended blocks are still in the cache, reading them back hits
+  fd = vsopen("cached.bin", MODE_READ);
+  cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vscache_stats(&stats), 0));
+  cr_assert(ge(ulong, stats.hits, 2));
+  cr_assert(eq(ulong, stats.misses, 0));
+  cr_assert(eq(int, vsumount(), 0));
+  vscache_setsize(VSFS_CACHE_DEFAULT_BLOCKS);
+}
+
+Test(vsfs, vsappend_large_writes_around_cache, .disabled = false)
+{
+  char data[8 * BLOCKSIZE];
+  char readback[8 * BLOCKSIZE];
+  struct vsfs_cachestats stats;
+  memset(data, 'w', sizeof(data));
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vscache_setsize(4), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("large.bin"), 0));
+  int fd = vsopen("large.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, sizeof(data)), 0));
+  vsclose(fd);
+
+  // a run longer than half the cache goes straight to the disk and
+  // leaves nothing in the cache, reading it back misses every block
+  fd = vsopen("large.bin", MODE_READ);
+  cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vscache_stats(&stats), 0));
+  cr_assert(eq(ulong, stats.hits, 0));
+  cr_assert(eq(ulong, stats.misses, 8));
+  cr_assert(eq(ulong, stats.evictions, 0));
+  cr_assert(eq(int, vsumount(), 0));
+  vscache_setsize(VSFS_CACHE_DEFAULT_BLOCKS);
+}
+
+Test(vsfs, vsumount_writes_dirty_metadata_only, .disabled = false)
+{
+  char marker[16];
+  char ondisk[16];
+  memset(marker, 0x5a, sizeof(marker));
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  // scribble over the last root directory block (block 10 of a 2^20
+  // byte disk), which no file below touches
+  FILE *disk = fopen(vdiskname, "r+b");
+  fseek(disk, 10L * BLOCKSIZE + BLOCKSIZE - sizeof(marker), SEEK_SET);
+  fwrite(marker, 1, sizeof(marker), disk);
+  fclose(disk);
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("dirty.bin"), 0));
+  int fd = vsopen("dirty.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, marker, sizeof(marker)), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+
+  disk = fopen(vdiskname, "rb");
+  fseek(disk, 10L * BLOCKSIZE + BLOCKSIZE - sizeof(marker), SEEK_SET);
+  cr_assert(eq(int, fread(ondisk, 1, sizeof(ondisk), disk), sizeof(ondisk)));
+  fclose(disk);
+  cr_assert(eq(int, memcmp(marker, ondisk, sizeof(marker)), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("dirty.bin", MODE_READ);
+  cr_assert(eq(int, vssize(fd), sizeof(marker)));
+  vsclose(fd);
+  vsumount();
+}
+
+Test(vsfs, vsdelete_releases_blocks, .disabled = false)
+{
+  // 2^18 bytes is 128 blocks, 117 of them data blocks
+  int datasize = 117 * BLOCKSIZE;
+  char *data = (char *)calloc(1, datasize + 1);
+  cr_assert(eq(int, vsformat(vdiskname, 18), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  for (int round = 0; round < 3; round++)
+  {
+    cr_assert(eq(int, vscreate("full.bin"), 0));
+    int fd = vsopen("full.bin", MODE_APPEND);
+    cr_assert(eq(int, vsappend(fd, data, datasize), 0));
+    // the disk is full now
+    cr_assert(eq(int, vsappend(fd, data, 1), -1));
+    vsclose(fd);
+    cr_assert(eq(int, vsdelete("full.bin"), 0));
+  }
+  vsumount();
+  free(data);
+}
+
+Test(vsfs, vsappend_contiguous_extent, .disabled = false)
+{
+  int datasize = 10 * BLOCKSIZE;
+  char *data = (char *)malloc(datasize);
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 7 + i / 251);
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  // fragment the free space first
+  cr_assert(eq(int, vscreate("a.bin"), 0));
+  cr_assert(eq(int, vscreate("b.bin"), 0));
+  int fda = vsopen("a.bin", MODE_APPEND);
+  int fdb = vsopen("b.bin", MODE_APPEND);
+  for (int i = 0; i < 4; i++)
+  {
+    cr_assert(eq(int, vsappend(fda, data, BLOCKSIZE), 0));
+    cr_assert(eq(int, vsappend(fdb, data, BLOCKSIZE), 0));
+  }
+  vsclose(fda);
+  vsclose(fdb);
+  cr_assert(eq(int, vsdelete("a.bin"), 0));
+
+  cr_assert(eq(int, vscreate("big.bin"), 0));
+  int fd = vsopen("big.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, datasize), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+
+  // the whole append landed in one run of consecutive blocks
+  FILE *disk = fopen(vdiskname, "rb");
+  fseek(disk, 0, SEEK_END);
+  long disksize = ftell(disk);
+  char *image = (char *)malloc(disksize);
+  fseek(disk, 0, SEEK_SET);
+  cr_assert(eq(long, fread(image, 1, disksize, disk), disksize));
+  fclose(disk);
+  cr_assert(ne(ptr, memmem(image, disksize, data, datasize), NULL));
+  free(image);
+  free(data);
+}
+
+Test(vsfs, vsappend_vsread_unaligned_large, .disabled = false)
+{
+  int datasize = 300 * 1024 + 77;
+  char *data = (char *)malloc(datasize);
+  char *readback = (char *)malloc(datasize);
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 13 + i / 509);
+  cr_assert(eq(int, vsformat(vdiskname, 21), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("large.bin"), 0));
+  int fd = vsopen("large.bin", MODE_APPEND);
+  // partial tail first, then a large append that fills it and goes on
+  cr_assert(eq(int, vsappend(fd, data, 100), 0));
+  cr_assert(eq(int, vsappend(fd, data + 100, datasize - 100), 0));
+  vsclose(fd);
+
+  fd = vsopen("large.bin", MODE_READ);
+  cr_assert(eq(int, vsread(fd, readback, 3), 0));
+  cr_assert(eq(int, vsread(fd, readback + 3, 200000), 0));
+  cr_assert(eq(int, vsread(fd, readback + 200003, datasize - 200003), 0));
+  cr_assert(eq(int, memcmp(data, readback, datasize), 0));
+  vsclose(fd);
+  vsumount();
+  free(data);
+  free(readback);
+}
+
+Test(vsfs, directory_index_churn, .disabled = false)
+{
+  char name[30];
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  for (int i = 0; i < 128; i++)
+  {
+    sprintf(name, "file%d", i);
+    cr_assert(eq(int, vscreate(name), 0));
+  }
+  cr_assert(eq(int, vscreate("file7"), -1));
+
+  // delete and recreate many times to leave tombstones behind
+  for (int round = 0; round < 1000; round++)
+  {
+    sprintf(name, "file%d", round % 128);
+    cr_assert(eq(int, vsdelete(name), 0));
+    cr_assert(eq(int, vsopen(name, MODE_READ), -1));
+    sprintf(name, "new%d", round);
+    cr_assert(eq(int, vscreate(name), 0));
+    cr_assert(eq(int, vsdelete(name), 0));
+    sprintf(name, "file%d", round % 128);
+    cr_assert(eq(int, vscreate(name), 0));
+  }
+  cr_assert(eq(int, vsumount(), 0));
+
+  // the index is rebuilt from the directory on mount
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  for (int i = 0; i < 128; i++)
+  {
+    sprintf(name, "file%d", i);
+    int fd = vsopen(name, MODE_READ);
+    cr_assert(ge(int, fd, 0));
+    vsclose(fd);
+  }
+  cr_assert(eq(int, vsopen("new5", MODE_READ), -1));
+  vsumount();
+}
+
+Test(vsfs, directory_grows_past_root, .disabled = false)
+{
+  char name[30];
+  int filecount = 5000;
+  cr_assert(eq(int, vsformat(vdiskname, 23), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  for (int i = 0; i < filecount; i++)
+  {
+    sprintf(name, "object-%d", i);
+    cr_assert(eq(int, vscreate(name), 0));
+  }
+  // keep one small file open next to the descriptors of others
+  int fd = vsopen("object-4321", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, name, 8), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsdelete("object-17"), 0));
+  cr_assert(eq(int, vsumount(), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  for (int i = 0; i < filecount; i++)
+  {
+    sprintf(name, "object-%d", i);
+    fd = vsopen(name, MODE_READ);
+    if (i == 17)
+    {
+      cr_assert(eq(int, fd, -1));
+      continue;
+    }
+    cr_assert(ge(int, fd, 0));
+    cr_assert(eq(int, vssize(fd), i == 4321 ? 8 : 0));
+    vsclose(fd);
+  }
+  // the freed slot is reused before the directory grows again
+  cr_assert(eq(int, vscreate("object-17"), 0));
+  vsumount();
+}
+
+Test(vsfs, large_volume, .disabled = false)
+{
+  // more than the 4096 blocks a v1 disk could address
+  int datasize = 12 * 1024 * 1024 + 5;
+  char *data = (char *)malloc(datasize);
+  char *readback = (char *)malloc(datasize);
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 11 + i / 4093);
+  cr_assert(eq(int, vsformat(vdiskname, 24), 0));
+  cr_assert(eq(int, vsformat(vdiskname, 37), -1));
+  cr_assert(eq(int, vsformat(vdiskname, 26), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("large.bin"), 0));
+  int fd = vsopen("large.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, datasize), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("large.bin", MODE_READ);
+  cr_assert(eq(int, vssize(fd), datasize));
+  cr_assert(eq(int, vsread(fd, readback, datasize), 0));
+  cr_assert(eq(int, memcmp(data, readback, datasize), 0));
+  vsclose(fd);
+  vsumount();
+  free(data);
+  free(readback);
+}
+
+Test(vsfs, vsmount_v1_disk, .disabled = false)
+{
+  // a v1 disk: superblock with the block count, block size and free bit
+  // vector, FAT in blocks 1-32, root directory in 33-40, data from 41
+  char data[100];
+  char readback[100];
+  memset(data, 'o', sizeof(data));
+  FILE *disk = fopen(vdiskname, "w+b");
+  char *image = (char *)calloc(128, BLOCKSIZE);
+  int blockcount = 128;
+  uint16_t blocksize = BLOCKSIZE;
+  memcpy(image, &blockcount, sizeof(blockcount));
+  memcpy(image + 4, &blocksize, sizeof(blocksize));
+  memset(image + 6, 0xff, 512);
+  fwrite(image, BLOCKSIZE, 128, disk);
+  fclose(disk);
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("old.bin"), 0));
+  int fd = vsopen("old.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, sizeof(data)), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+
+  // the disk keeps its v1 layout
+  disk = fopen(vdiskname, "rb");
+  cr_assert(eq(int, fread(image, BLOCKSIZE, 128, disk), 128));
+  fclose(disk);
+  cr_assert(eq(int, memcmp(image + 41 * BLOCKSIZE, data, sizeof(data)), 0));
+  cr_assert(eq(int, image[6] & 1, 0));
+
+  // v1 never initialised the bytes after startblock, they may hold
+  // anything and are not flags there
+  for (int entry = 0; entry < 8 * BLOCKSIZE / 128; entry++)
+    memset(image + 33 * BLOCKSIZE + entry * 128 + 44, 0xff, 128 - 44);
+  disk = fopen(vdiskname, "r+b");
+  fwrite(image, BLOCKSIZE, 128, disk);
+  fclose(disk);
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("old.bin", MODE_READ);
+  cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  vsumount();
+  free(image);
+}
+
+Test(vsfs, vsformat_blocksize, .disabled = false)
+{
+  int sizes[] = {VSFS_MIN_BLOCKSIZE, 4096, VSFS_MAX_BLOCKSIZE};
+  int datasize = 700 * 1024 + 3;
+  char *data = (char *)malloc(datasize);
+  char *readback = (char *)malloc(datasize);
+  char name[30];
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 5 + i / 1021);
+  cr_assert(eq(int, vsformat_ex(vdiskname, 20, 3000, 0), -1));
+  cr_assert(eq(int, vsformat_ex(vdiskname, 20, 256, 0), -1));
+  // 2^18 bytes are 4 blocks of 64 KB, all of them metadata
+  cr_assert(eq(int, vsformat_ex(vdiskname, 18, VSFS_MAX_BLOCKSIZE, 0), -1));
+  for (int s = 0; s < 3; s++)
+  {
+    cr_assert(eq(int, vsformat_ex(vdiskname, 22, sizes[s], 0), 0));
+    cr_assert(eq(int, vsmount(vdiskname), 0));
+    // more files than fit in the root directory of 512 byte blocks
+    for (int i = 0; i < 40; i++)
+    {
+      sprintf(name, "small%d", i);
+      cr_assert(eq(int, vscreate(name), 0));
+      int fd = vsopen(name, MODE_APPEND);
+      cr_assert(eq(int, vsappend(fd, data + i, i + 1), 0));
+      vsclose(fd);
+    }
+    cr_assert(eq(int, vscreate("large.bin"), 0));
+    int fd = vsopen("large.bin", MODE_APPEND);
+    cr_assert(eq(int, vsappend(fd, data, 1000), 0));
+    cr_assert(eq(int, vsappend(fd, data + 1000, datasize - 1000), 0));
+    vsclose(fd);
+    cr_assert(eq(int, vsumount(), 0));
+
+    cr_assert(eq(int, vsmount(vdiskname), 0));
+    for (int i = 0; i < 40; i++)
+    {
+      sprintf(name, "small%d", i);
+      fd = vsopen(name, MODE_READ);
+      cr_assert(eq(int, vssize(fd), i + 1));
+      cr_assert(eq(int, vsread(fd, readback, i + 1), 0));
+      cr_assert(eq(int, memcmp(data + i, readback, i + 1), 0));
+      vsclose(fd);
+    }
+    fd = vsopen("large.bin", MODE_READ);
+    cr_assert(eq(int, vssize(fd), datasize));
+    cr_assert(eq(int, vsread(fd, readback, 7), 0));
+    cr_assert(eq(int, vsread(fd, readback + 7, datasize - 7), 0));
+    cr_assert(eq(int, memcmp(data, readback, datasize), 0));
+    vsclose(fd);
+    cr_assert(eq(int, vsumount(), 0));
+  }
+  free(data);
+  free(readback);
+}
+
+Test(vsfs, vsformat_sparse, .disabled = false)
+{
+  char data[5000];
+  char readback[5000];
+  memset(data, 's', sizeof(data));
+  // a 1 GB disk, of which only the superblock and a bitmap block are written
+  cr_assert(eq(int, vsformat_ex(vdiskname, 30, BLOCKSIZE, VSFS_FORMAT_SPARSE), 0));
+  struct stat sb;
+  cr_assert(eq(int, stat(vdiskname, &sb), 0));
+  cr_assert(eq(long, (long)sb.st_size, 1L << 30));
+  cr_assert(le(long, (long)sb.st_blocks * 512, 64L * 1024));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("sparse.bin"), 0));
+  int fd = vsopen("sparse.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, sizeof(data)), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("sparse.bin", MODE_READ);
+  cr_assert(eq(int, vssize(fd), sizeof(data)));
+  cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+  cr_assert(eq(int, memcmp(data, readback, sizeof(data)), 0));
+  vsclose(fd);
+  vsumount();
+}
+
+Test(vsfs, vsseek_vspread, .disabled = false)
+{
+  int datasize = 50 * BLOCKSIZE + 123;
+  char *data = (char *)malloc(datasize);
+  char readback[3 * BLOCKSIZE];
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 17 + i / 2039);
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  // interleave two files so that the chain of the first one is scattered
+  cr_assert(eq(int, vscreate("records.bin"), 0));
+  cr_assert(eq(int, vscreate("other.bin"), 0));
+  int fd = vsopen("records.bin", MODE_APPEND);
+  int other = vsopen("other.bin", MODE_APPEND);
+  for (int done = 0; done < datasize; done += 3000)
+  {
+    int n = datasize - done < 3000 ? datasize - done : 3000;
+    cr_assert(eq(int, vsappend(fd, data + done, n), 0));
+    cr_assert(eq(int, vsappend(other, data, 2 * BLOCKSIZE), 0));
+  }
+  cr_assert(eq(int, vspread(fd, readback, 10, 0), -1));
+  cr_assert(eq(long, vsseek(fd, 0, SEEK_SET), -1));
+  vsclose(fd);
+  vsclose(other);
+
+  fd = vsopen("records.bin", MODE_READ);
+  cr_assert(eq(int, vsread(fd, readback, 100), 0));
+  srand(7);
+  for (int i = 0; i < 200; i++)
+  {
+    int offset = rand() % datasize;
+    int n = rand() % (int)sizeof(readback);
+    if (n > datasize - offset)
+      n = datasize - offset;
+    cr_assert(eq(int, vspread(fd, readback, n, offset), 0));
+    cr_assert(eq(int, memcmp(data + offset, readback, n), 0));
+  }
+  // vspread leaves the cursor where vsread put it
+  cr_assert(eq(int, vsread(fd, readback, 100), 0));
+  cr_assert(eq(int, memcmp(data + 100, readback, 100), 0));
+
+  cr_assert(eq(long, vsseek(fd, 5 * BLOCKSIZE - 7, SEEK_SET), 5 * BLOCKSIZE - 7));
+  cr_assert(eq(long, vsseek(fd, 10, SEEK_CUR), 5 * BLOCKSIZE + 3));
+  cr_assert(eq(int, vsread(fd, readback, 2 * BLOCKSIZE), 0));
+  cr_assert(eq(int, memcmp(data + 5 * BLOCKSIZE + 3, readback, 2 * BLOCKSIZE), 0));
+  cr_assert(eq(long, vsseek(fd, -123, SEEK_END), datasize - 123));
+  cr_assert(eq(int, vsread(fd, readback, 123), 0));
+  cr_assert(eq(int, memcmp(data + datasize - 123, readback, 123), 0));
+  cr_assert(eq(long, vsseek(fd, 1, SEEK_END), -1));
+  cr_assert(eq(long, vsseek(fd, -1, SEEK_SET), -1));
+  cr_assert(eq(long, vsseek(fd, 0, SEEK_END), datasize));
+  vsclose(fd);
+  vsumount();
+  free(data);
+}
+
+#define THREAD_FILES 4
+
+struct thread_work
+{
+  vsfs_t *fs;
+  int index;
+  int status;
+};
+
+// append to a file of its own in uneven pieces, then read it back
+static void *thread_appendread(void *arg)
+{
+  struct thread_work *work = (struct thread_work *)arg;
+  char filename[16], piece[3000], readback[3000];
+  snprintf(filename, sizeof(filename), "thread%d", work->index);
+  work->status = -1;
+  int fd = vsfs_open(work->fs, filename, MODE_APPEND);
+  for (int i = 0; i < 40; i++)
+  {
+    memset(piece, 'a' + work->index, sizeof(piece));
+    piece[0] = (char)i;
+    if (vsfs_append(work->fs, fd, piece, 1000 + 50 * i) != 0)
+      return NULL;
+  }
+  vsfs_close(work->fs, fd);
+  fd = vsfs_open(work->fs, filename, MODE_READ);
+  for (int i = 0; i < 40; i++)
+  {
+    if (vsfs_read(work->fs, fd, readback, 1000 + 50 * i) != 0)
+      return NULL;
+    if (readback[0] != (char)i || readback[999 + 50 * i] != 'a' + work->index)
+      return NULL;
+  }
+  work->status = vsfs_close(work->fs, fd);
+  return NULL;
+}
+
+Test(vsfs, vsfs_handles_threads, .disabled = false)
+{
+  cr_assert(eq(int, vsformat_ex("vdisk1.bin", 22, BLOCKSIZE, VSFS_FORMAT_JOURNAL), 0));
+  cr_assert(eq(int, vsformat_ex("vdisk2.bin", 22, 4096, 0), 0));
+  vsfs_t *first = vsfs_mount("vdisk1.bin", 0);
+  vsfs_t *second = vsfs_mount("vdisk2.bin", VSFS_MOUNT_MMAP);
+  cr_assert(first != NULL && second != NULL);
+  vsfs_t *mounts[2] = {first, second};
+
+  // the same file name on both disks, with different contents
+  cr_assert(eq(int, vsfs_create(first, "shared"), 0));
+  cr_assert(eq(int, vsfs_create(second, "shared"), 0));
+  int fd1 = vsfs_open(first, "shared", MODE_APPEND);
+  int fd2 = vsfs_open(second, "shared", MODE_APPEND);
+  cr_assert(eq(int, vsfs_append(first, fd1, "first", 5), 0));
+  cr_assert(eq(int, vsfs_append(second, fd2, "second", 6), 0));
+  vsfs_close(first, fd1);
+  vsfs_close(second, fd2);
+
+  pthread_t threads[2 * THREAD_FILES];
+  struct thread_work work[2 * THREAD_FILES];
+  for (int i = 0; i < 2 * THREAD_FILES; i++)
+  {
+    work[i].fs = mounts[i % 2];
+    work[i].index = i;
+    char filename[16];
+    snprintf(filename, sizeof(filename), "thread%d", i);
+    cr_assert(eq(int, vsfs_create(work[i].fs, filename), 0));
+  }
+  for (int i = 0; i < 2 * THREAD_FILES; i++)
+    pthread_create(&threads[i], NULL, thread_appendread, &work[i]);
+  for (int i = 0; i < 2 * THREAD_FILES; i++)
+  {
+    pthread_join(threads[i], NULL);
+    cr_assert(eq(int, work[i].status, 0));
+  }
+  cr_assert(eq(int, vsfs_umount(first), 0));
+  cr_assert(eq(int, vsfs_umount(second), 0));
+
+  // everything made it to the right disk
+  char readback[8];
+  first = vsfs_mount("vdisk1.bin", 0);
+  second = vsfs_mount("vdisk2.bin", 0);
+  fd1 = vsfs_open(first, "shared", MODE_READ);
+  fd2 = vsfs_open(second, "shared", MODE_READ);
+  cr_assert(eq(int, vsfs_size(first, fd1), 5));
+  cr_assert(eq(int, vsfs_size(second, fd2), 6));
+  cr_assert(eq(int, vsfs_read(second, fd2, readback, 6), 0));
+  cr_assert(eq(int, memcmp(readback, "second", 6), 0));
+  cr_assert(eq(int, vsfs_open(first, "thread1", MODE_READ), -1));
+  int fd = vsfs_open(first, "thread0", MODE_READ);
+  cr_assert(eq(int, vsfs_size(first, fd), 40 * 1000 + 50 * 39 * 40 / 2));
+  cr_assert(eq(int, vsfs_umount(first), 0));
+  cr_assert(eq(int, vsfs_umount(second), 0));
+}
+
+struct append_results
+{
+  pthread_mutex_t lock;
+  int done;
+  int failed;
+  int last; // appends of one fd complete in order
+};
+
+struct append_arg
+{
+  struct append_results *results;
+  int index;
+};
+
+static void count_append(void *arg, int fd, int status)
+{
+  struct append_arg *append = (struct append_arg *)arg;
+  struct append_results *results = append->results;
+  pthread_mutex_lock(&results->lock);
+  if (status != 0 || append->index != results->last + 1)
+    results->failed++;
+  results->last = append->index;
+  results->done++;
+  pthread_mutex_unlock(&results->lock);
+}
+
+Test(vsfs, vsasync, .disabled = false)
+{
+  static char data[64 * 1000];
+  for (int i = 0; i < (int)sizeof(data); i++)
+    data[i] = (char)(i * 13 + i / 1000);
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("async.bin"), 0));
+  int fd = vsopen("async.bin", MODE_APPEND);
+
+  struct append_results results = {PTHREAD_MUTEX_INITIALIZER, 0, 0, -1};
+  struct append_arg args[64];
+  for (int i = 0; i < 64; i++)
+  {
+    args[i].results = &results;
+    args[i].index = i;
+    cr_assert(eq(int, vsappend_async(fd, data + i * 1000, 1000, count_append, &args[i]), 0));
+  }
+  // vsclose does not wait for queued requests
+  for (;;)
+  {
+    pthread_mutex_lock(&results.lock);
+    int done = results.done;
+    pthread_mutex_unlock(&results.lock);
+    if (done == 64)
+      break;
+    usleep(1000);
+  }
+  cr_assert(eq(int, results.failed, 0));
+  vsclose(fd);
+
+  // reads without a callback land in the completion queue
+  fd = vsopen("async.bin", MODE_READ);
+  char *readback = (char *)malloc(sizeof(data));
+  for (int i = 0; i < 8; i++)
+    cr_assert(eq(int, vsread_async(fd, readback + i * 8000, 8000, NULL, (void *)(intptr_t)i), 0));
+  struct pollfd pfd = {vscompletion_fd(), POLLIN, 0};
+  int reaped = 0;
+  while (reaped < 8)
+  {
+    cr_assert(eq(int, poll(&pfd, 1, 5000), 1));
+    struct vsfs_completion completions[8];
+    int count = vspoll(completions, 8);
+    for (int i = 0; i < count; i++)
+    {
+      cr_assert(eq(int, completions[i].status, 0));
+      cr_assert(eq(int, (int)(intptr_t)completions[i].arg, reaped + i));
+    }
+    reaped += count;
+  }
+  struct vsfs_completion completion;
+  cr_assert(eq(int, vspoll(&completion, 1), 0));
+  cr_assert(eq(int, memcmp(readback, data, sizeof(data)), 0));
+  // a bad descriptor still completes, with the error
+  cr_assert(eq(int, vsread_async(100, readback, 10, NULL, NULL), 0));
+  cr_assert(eq(int, poll(&pfd, 1, 5000), 1));
+  cr_assert(eq(int, vspoll(&completion, 1), 1));
+  cr_assert(eq(int, completion.status, -1));
+  vsclose(fd);
+  vsumount();
+  free(readback);
+}
+
+Test(vsfs, vsread_readahead, .disabled = false)
+{
+  int datasize = 300 * BLOCKSIZE;
+  char *data = (char *)malloc(datasize);
+  char readback[BLOCKSIZE];
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 7 + i / 5003);
+  cr_assert(eq(int, vsformat(vdiskname, 21), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("stream.bin"), 0));
+  int fd = vsopen("stream.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, datasize), 0));
+  vsclose(fd);
+
+  // random reads never read ahead
+  struct vsfs_cachestats stats;
+  fd = vsopen("stream.bin", MODE_READ);
+  cr_assert(eq(int, vspread(fd, readback, 100, 77 * BLOCKSIZE), 0));
+  for (int i = 0; i < 20; i++)
+    cr_assert(eq(int, vspread(fd, readback, 100, ((i * 37) % 300) * BLOCKSIZE + 5), 0));
+  cr_assert(eq(int, vscache_stats(&stats), 0));
+  cr_assert(eq(int, (int)stats.readaheads, 0));
+
+  // a streaming reader has the whole file read ahead, each block once,
+  // positional reads in between do not disturb it
+  cr_assert(eq(long, vsseek(fd, 0, SEEK_SET), 0));
+  for (int offset = 0; offset < datasize; offset += 1000)
+  {
+    int n = datasize - offset < 1000 ? datasize - offset : 1000;
+    cr_assert(eq(int, vsread(fd, readback, n), 0));
+    cr_assert(eq(int, memcmp(data + offset, readback, n), 0));
+    if (offset % 50000 == 0)
+      cr_assert(eq(int, vspread(fd, readback, 100, 123), 0));
+  }
+  cr_assert(eq(int, vscache_stats(&stats), 0));
+  cr_assert(eq(int, (int)stats.readaheads, 300));
+  vsclose(fd);
+  vsumount();
+  free(data);
+}
+
+Test(vsfs, journal_replay, .disabled = false)
+{
+  char piece[100], readback[100];
+  cr_assert(eq(int, vsformat_ex(vdiskname, 22, BLOCKSIZE, VSFS_FORMAT_JOURNAL), 0));
+  pid_t child = fork();
+  if (child == 0)
+  {
+    // enough commits to fill the journal a few times, then crash
+    if (vsmount(vdiskname) != 0 || vscreate("log.txt") != 0 || vscreate("gone.txt") != 0)
+      _exit(1);
+    int fd = vsopen("log.txt", MODE_APPEND);
+    for (int i = 0; i < 500; i++)
+    {
+      memset(piece, 'a' + i % 26, sizeof(piece));
+      if (vsappend(fd, piece, sizeof(piece)) != 0)
+        _exit(1);
+    }
+    if (vsdelete("gone.txt") != 0 || vscreate("empty.txt") != 0)
+      _exit(1);
+    _exit(0);
+  }
+  int status;
+  cr_assert(eq(int, waitpid(child, &status, 0), child));
+  cr_assert(eq(int, WEXITSTATUS(status), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  int fd = vsopen("log.txt", MODE_READ);
+  cr_assert(eq(int, vssize(fd), 500 * 100));
+  for (int i = 0; i < 500; i++)
+  {
+    memset(piece, 'a' + i % 26, sizeof(piece));
+    cr_assert(eq(int, vsread(fd, readback, sizeof(readback)), 0));
+    cr_assert(eq(int, memcmp(piece, readback, sizeof(piece)), 0));
+  }
+  vsclose(fd);
+  cr_assert(eq(int, vsopen("gone.txt", MODE_READ), -1));
+  fd = vsopen("empty.txt", MODE_READ);
+  cr_assert(eq(int, vssize(fd), 0));
+  vsclose(fd);
+
+  // the data of a commit is synced before its transaction is written,
+  // and the transaction after
+  struct vsfs_stats before, after;
+  fd = vsopen("log.txt", MODE_APPEND);
+  cr_assert(eq(int, vsget_stats(&before), 0));
+  cr_assert(eq(int, vsappend(fd, piece, sizeof(piece)), 0));
+  cr_assert(eq(int, vsget_stats(&after), 0));
+  cr_assert(eq(u64, after.synccalls - before.synccalls, 2));
+  vsclose(fd);
+  cr_assert(eq(int, vsumount(), 0));
+}
+
+Test(vsfs, vsfsync_levels, .disabled = false)
+{
+  int datasize = 20 * BLOCKSIZE + 300;
+  char *data = (char *)malloc(datasize);
+  char *readback = (char *)malloc(datasize);
+  for (int i = 0; i < datasize; i++)
+    data[i] = (char)(i * 11 + i / 301);
+  cr_assert(eq(int, vsformat(vdiskname, 21), 0));
+  pid_t child = fork();
+  if (child == 0)
+  {
+    // checkpoint one file and crash
+    if (vsmount(vdiskname) != 0 || vscreate("shipped.log") != 0)
+      _exit(1);
+    int fd = vsopen("shipped.log", MODE_APPEND);
+    if (vsappend(fd, data, datasize) != 0 || vsfsync(fd, 3) != -1 || vsfsync(fd + 1, VSFS_SYNC_DATA) != -1)
+      _exit(1);
+    if (vsfsync(fd, VSFS_SYNC_DATA) != 0 || vsfsync(fd, VSFS_SYNC_METADATA) != 0)
+      _exit(1);
+    _exit(0);
+  }
+  int status;
+  cr_assert(eq(int, waitpid(child, &status, 0), child));
+  cr_assert(eq(int, WEXITSTATUS(status), 0));
+
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  int fd = vsopen("shipped.log", MODE_READ);
+  cr_assert(eq(int, vssize(fd), datasize));
+  cr_assert(eq(int, vsread(fd, readback, datasize), 0));
+  cr_assert(eq(int, memcmp(data, readback, datasize), 0));
+  vsclose(fd);
+  fd = vsopen("shipped.log", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 10), 0));
+  cr_assert(eq(int, vsfsync(fd, VSFS_SYNC_BARRIER), 0));
+  vsclose(fd);
+  vsumount();
+  free(data);
+  free(readback);
+}
+
+Test(vsfs, vsget_stats, .disabled = false)
+{
+  int datasize = 10 * BLOCKSIZE;
+  char *data = (char *)malloc(datasize);
+  memset(data, 's', datasize);
+  struct vsfs_stats stats;
+  cr_assert(eq(int, vsget_stats(&stats), -1)); // not mounted
+  cr_assert(eq(int, vsformat(vdiskname, 21), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("counted.bin"), 0));
+  int fd = vsopen("counted.bin", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, datasize), 0));
+  vsclose(fd);
+  fd = vsopen("counted.bin", MODE_READ);
+  cr_assert(eq(int, vsread(fd, data, datasize), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsget_stats(&stats), 0));
+
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_MOUNT], 1));
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_CREATE], 1));
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_OPEN], 2));
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_CLOSE], 2));
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_APPEND], 1));
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_READ], 1));
+  cr_assert(eq(int, (int)stats.calls[VSFS_CALL_DELETE], 0));
+  // every timed call lands in exactly one bucket
+  for (int call = 0; call < VSFS_CALLS; call++)
+  {
+    unsigned long bucketed = 0;
+    for (int i = 0; i < VSFS_LATENCY_BUCKETS; i++)
+      bucketed += stats.latency[call][i];
+    cr_assert(eq(u64, bucketed, stats.calls[call]));
+  }
+  cr_assert(gt(u64, stats.latencyns[VSFS_CALL_MOUNT], 0));
+
+  cr_assert(ge(u64, stats.blockwrites, 10));
+  cr_assert(ge(u64, stats.blockreads, 10));
+  cr_assert(ge(u64, stats.byteswritten, stats.blockwrites * BLOCKSIZE));
+  cr_assert(gt(u64, stats.writecalls, 0));
+  cr_assert(gt(u64, stats.readcalls, 0));
+  cr_assert(ge(u64, stats.fathops, 9)); // the chain of the read file
+  cr_assert(ge(u64, stats.dirprobes, 4)); // a lookup and an insert by vscreate, two vsopen
+  cr_assert(gt(u64, stats.allocations, 0));
+  cr_assert(ge(u64, stats.bitsscanned, 64));
+  vsumount();
+  free(data);
+}
+
+Test(vsfs, vsappend_inline, .disabled = false)
+{
+  char marker[] = "ready";
+  char config[60];
+  char readback[200];
+  for (int i = 0; i < (int)sizeof(config); i++)
+    config[i] = (char)('a' + i % 26);
+  struct vsfs_stats before, after;
+  cr_assert(eq(int, vsformat(vdiskname, 21), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("marker"), 0));
+  cr_assert(eq(int, vscreate("config"), 0));
+  cr_assert(eq(int, vsget_stats(&before), 0));
+  int fd = vsopen("marker", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, marker, 5), 0));
+  vsclose(fd);
+  fd = vsopen("config", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, config, 30), 0));
+  cr_assert(eq(int, vsappend(fd, config + 30, 30), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsget_stats(&after), 0));
+  cr_assert(eq(u64, after.allocations, before.allocations));
+  vsumount();
+
+  // both files come back from the directory without a data block read
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vsget_stats(&before), 0));
+  fd = vsopen("marker", MODE_READ);
+  cr_assert(eq(int, vssize(fd), 5));
+  cr_assert(eq(int, vsread(fd, readback, 5), 0));
+  cr_assert(eq(int, memcmp(readback, marker, 5), 0));
+  vsclose(fd);
+  fd = vsopen("config", MODE_READ);
+  cr_assert(eq(int, vspread(fd, readback, 20, 25), 0));
+  cr_assert(eq(int, memcmp(readback, config + 25, 20), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsget_stats(&after), 0));
+  cr_assert(eq(u64, after.blockreads, before.blockreads));
+
+  // outgrowing the entry moves the file to a data block
+  fd = vsopen("config", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, config, 60), 0));
+  vsclose(fd);
+  vsumount();
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("config", MODE_READ);
+  cr_assert(eq(int, vssize(fd), 120));
+  cr_assert(eq(int, vsread(fd, readback, 120), 0));
+  cr_assert(eq(int, memcmp(readback, config, 60), 0));
+  cr_assert(eq(int, memcmp(readback + 60, config, 60), 0));
+  vsclose(fd);
+  cr_assert(eq(int, vsdelete("marker"), 0));
+  cr_assert(eq(int, vscreate("marker"), 0));
+  fd = vsopen("marker", MODE_READ);
+  cr_assert(eq(int, vssize(fd), 0));
+  vsclose(fd);
+  vsumount();
+}
+
+static void small_object(char *data, int file, int size)
+{
+  for (int i = 0; i < size; i++)
+    data[i] = (char)(file * 31 + i);
+}
+
+Test(vsfs, vsclose_packs_tails, .disabled = false)
+{
+  char filename[32];
+  char data[3 * BLOCKSIZE];
+  char readback[3 * BLOCKSIZE];
+  struct vsfs_stats before, after;
+  cr_assert(eq(int, vsformat(vdiskname, 18), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+
+  // a disk of 128 blocks only survives the rounds if pack blocks are
+  // given back once their files are gone
+  for (int round = 0; round < 20; round++)
+  {
+    for (int file = 0; file < 100; file++)
+    {
+      snprintf(filename, sizeof(filename), "object%d", file);
+      small_object(data, file + round, 300);
+      cr_assert(eq(int, vscreate(filename), 0));
+      int fd = vsopen(filename, MODE_APPEND);
+      cr_assert(eq(int, vsappend(fd, data, 300), 0));
+      cr_assert(eq(int, vsclose(fd), 0));
+    }
+    if (round == 19)
+      break;
+    for (int file = 0; file < 100; file++)
+    {
+      snprintf(filename, sizeof(filename), "object%d", file);
+      cr_assert(eq(int, vsdelete(filename), 0));
+    }
+  }
+  // a file with whole blocks in front of its tail
+  small_object(data, 7, 2 * BLOCKSIZE + 100);
+  cr_assert(eq(int, vscreate("long"), 0));
+  int fd = vsopen("long", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 2 * BLOCKSIZE + 100), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  vsumount();
+
+  // 100 objects come from a handful of blocks
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vsget_stats(&before), 0));
+  for (int file = 0; file < 100; file++)
+  {
+    snprintf(filename, sizeof(filename), "object%d", file);
+    small_object(data, file + 19, 300);
+    fd = vsopen(filename, MODE_READ);
+    cr_assert(eq(int, vssize(fd), 300));
+    cr_assert(eq(int, vsread(fd, readback, 100), 0));
+    cr_assert(eq(int, vsread(fd, readback + 100, 200), 0));
+    cr_assert(eq(int, memcmp(readback, data, 300), 0));
+    vsclose(fd);
+  }
+  cr_assert(eq(int, vsget_stats(&after), 0));
+  cr_assert(le(u64, after.blockreads - before.blockreads, 20));
+
+  small_object(data, 7, 2 * BLOCKSIZE + 100);
+  fd = vsopen("long", MODE_READ);
+  cr_assert(eq(int, vspread(fd, readback, 200, 2 * BLOCKSIZE - 100), 0));
+  cr_assert(eq(int, memcmp(readback, data + 2 * BLOCKSIZE - 100, 200), 0));
+  cr_assert(eq(int, vsread(fd, readback, 2 * BLOCKSIZE + 100), 0));
+  cr_assert(eq(int, memcmp(readback, data, 2 * BLOCKSIZE + 100), 0));
+  vsclose(fd);
+
+  // appending takes the tail out of its pack block again, and the
+  // neighbours of a deleted file keep theirs
+  small_object(data, 3 + 19, 300);
+  fd = vsopen("object3", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 300), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  for (int file = 0; file < 100; file += 2)
+  {
+    snprintf(filename, sizeof(filename), "object%d", file);
+    cr_assert(eq(int, vsdelete(filename), 0));
+  }
+  vsumount();
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  fd = vsopen("object3", MODE_READ);
+  cr_assert(eq(int, vssize(fd), 600));
+  cr_assert(eq(int, vsread(fd, readback, 600), 0));
+  cr_assert(eq(int, memcmp(readback, data, 300), 0));
+  cr_assert(eq(int, memcmp(readback + 300, data, 300), 0));
+  vsclose(fd);
+  for (int file = 1; file < 100; file += 2)
+  {
+    snprintf(filename, sizeof(filename), "object%d", file);
+    small_object(data, file + 19, 300);
+    fd = vsopen(filename, MODE_READ);
+    cr_assert(eq(int, vsread(fd, readback, 300), 0));
+    cr_assert(eq(int, memcmp(readback, data, 300), 0));
+    vsclose(fd);
+  }
+  vsumount();
+}
+
+// contents that differ from block to block
+static void clone_object(char *data, int seed, int size)
+{
+  for (int i = 0; i < size; i++)
+    data[i] = (char)(seed + i / BLOCKSIZE * 13 + i);
+}
+
+static void check_contents(char *filename, char *expected, int size)
+{
+  char *readback = (char *)malloc(size + 1);
+  int fd = vsopen(filename, MODE_READ);
+  cr_assert(eq(int, vssize(fd), size));
+  cr_assert(eq(int, vsread(fd, readback, size), 0));
+  cr_assert(eq(int, memcmp(readback, expected, size), 0));
+  vsclose(fd);
+  free(readback);
+}
+
+Test(vsfs, vsclone_shares_blocks, .disabled = false)
+{
+  static char base[16 * BLOCKSIZE];
+  static char copy[16 * BLOCKSIZE];
+  static char data[4 * BLOCKSIZE];
+  struct vsfs_stats before, after;
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+
+  int size = 10 * BLOCKSIZE + 1500;
+  clone_object(base, 1, size);
+  cr_assert(eq(int, vscreate("base"), 0));
+  int fd = vsopen("base", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, base, size), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+
+  // no block is allocated or written for the clone
+  cr_assert(eq(int, vsget_stats(&before), 0));
+  cr_assert(eq(int, vsclone("base", "copy"), 0));
+  cr_assert(eq(int, vsget_stats(&after), 0));
+  cr_assert(eq(u64, after.allocations, before.allocations));
+  cr_assert(eq(int, vsclone("base", "copy"), -1));
+  cr_assert(eq(int, vsclone("missing", "other"), -1));
+  memcpy(copy, base, size);
+  check_contents("base", base, size);
+  check_contents("copy", copy, size);
+
+  // appends to either file leave the other one alone
+  clone_object(data, 2, 2 * BLOCKSIZE + 100);
+  fd = vsopen("copy", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 100), 0));
+  cr_assert(eq(int, vsappend(fd, data + 100, 2 * BLOCKSIZE), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  memcpy(copy + size, data, 2 * BLOCKSIZE + 100);
+  int copysize = size + 2 * BLOCKSIZE + 100;
+  clone_object(data, 3, 3000);
+  fd = vsopen("base", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 3000), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  memcpy(base + size, data, 3000);
+  size += 3000;
+  check_contents("base", base, size);
+  check_contents("copy", copy, copysize);
+
+  // a clone of a clone, then the original goes away
+  cr_assert(eq(int, vsclone("copy", "copy2"), 0));
+  clone_object(data, 4, 500);
+  fd = vsopen("copy2", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 500), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  cr_assert(eq(int, vsdelete("base"), 0));
+  check_contents("copy", copy, copysize);
+  vsumount();
+
+  // the counts are rebuilt on mount
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  clone_object(data, 5, BLOCKSIZE);
+  fd = vsopen("copy", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, BLOCKSIZE), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  memcpy(copy + copysize, data, BLOCKSIZE);
+  check_contents("copy", copy, copysize + BLOCKSIZE);
+  clone_object(data, 4, 500);
+  memcpy(base, copy, copysize);
+  memcpy(base + copysize, data, 500);
+  check_contents("copy2", base, copysize + 500);
+  cr_assert(eq(int, vsdelete("copy"), 0));
+  cr_assert(eq(int, vsdelete("copy2"), 0));
+  vsumount();
+
+  // a small disk only survives the rounds if shared blocks are given
+  // back once no clone holds them anymore
+  cr_assert(eq(int, vsformat(vdiskname, 18), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  size = 8 * BLOCKSIZE + 1500;
+  clone_object(base, 6, size);
+  for (int round = 0; round < 30; round++)
+  {
+    cr_assert(eq(int, vscreate("base"), 0));
+    fd = vsopen("base", MODE_APPEND);
+    cr_assert(eq(int, vsappend(fd, base, size), 0));
+    cr_assert(eq(int, vsclose(fd), 0));
+    cr_assert(eq(int, vsclone("base", "copy"), 0));
+    fd = vsopen("copy", MODE_APPEND);
+    cr_assert(eq(int, vsappend(fd, base, BLOCKSIZE), 0));
+    cr_assert(eq(int, vsclose(fd), 0));
+    cr_assert(eq(int, vsdelete(round % 2 == 0 ? "base" : "copy"), 0));
+    cr_assert(eq(int, vsdelete(round % 2 == 0 ? "copy" : "base"), 0));
+  }
+  vsumount();
+}
+
+Test(vsfs, vspwrite_in_place, .disabled = false)
+{
+  static char data[2049 * BLOCKSIZE];
+  static char record[3 * BLOCKSIZE];
+  struct vsfs_stats before, after;
+  int size = 2048 * BLOCKSIZE;
+  cr_assert(eq(int, vsformat(vdiskname, 23), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  clone_object(data, 1, size);
+  cr_assert(eq(int, vscreate("big"), 0));
+  int fd = vsopen("big", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, size), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+
+  // 100 bytes in the middle of 4 MB write one block
+  clone_object(record, 2, 100);
+  cr_assert(eq(int, vssync(), 0));
+  cr_assert(eq(int, vsget_stats(&before), 0));
+  fd = vsopen("big", MODE_WRITE);
+  cr_assert(eq(int, vsappend(fd, record, 100), -1));
+  cr_assert(eq(int, vspwrite(fd, record, 100, 1000 * BLOCKSIZE + 300), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  cr_assert(eq(int, vssync(), 0));
+  cr_assert(eq(int, vsget_stats(&after), 0));
+  cr_assert(eq(u64, after.blockwrites - before.blockwrites, 1));
+  memcpy(data + 1000 * BLOCKSIZE + 300, record, 100);
+  check_contents("big", data, size);
+
+  // across block boundaries and past the end
+  clone_object(record, 3, 3 * BLOCKSIZE);
+  fd = vsopen("big", MODE_WRITE);
+  cr_assert(eq(int, vspwrite(fd, record, 3 * BLOCKSIZE, 5 * BLOCKSIZE - 10), 0));
+  cr_assert(eq(int, vspwrite(fd, record, 2 * BLOCKSIZE, size - BLOCKSIZE), 0));
+  cr_assert(eq(int, vspwrite(fd, record, 10, size + 2 * BLOCKSIZE), -1));
+  cr_assert(eq(int, vsclose(fd), 0));
+  memcpy(data + 5 * BLOCKSIZE - 10, record, 3 * BLOCKSIZE);
+  memcpy(data + size - BLOCKSIZE, record, 2 * BLOCKSIZE);
+  check_contents("big", data, size + BLOCKSIZE);
+  cr_assert(eq(int, vsdelete("big"), 0));
+
+  // a clone keeps the old contents, the shared blocks are copied
+  clone_object(data, 4, 6 * BLOCKSIZE + 700);
+  cr_assert(eq(int, vscreate("base"), 0));
+  fd = vsopen("base", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 6 * BLOCKSIZE + 700), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  cr_assert(eq(int, vsclone("base", "copy"), 0));
+  clone_object(record, 5, 3 * BLOCKSIZE);
+  fd = vsopen("copy", MODE_WRITE);
+  cr_assert(eq(int, vspwrite(fd, record, 50, 2 * BLOCKSIZE + 10), 0));
+  cr_assert(eq(int, vspwrite(fd, record, BLOCKSIZE, 6 * BLOCKSIZE), 0));
+  cr_assert(eq(int, vspwrite(fd, record, 100, 0), 0));
+  cr_assert(eq(int, vspwrite(fd, record, 100, 4 * BLOCKSIZE), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  static char copy[8 * BLOCKSIZE];
+  memcpy(copy, data, 6 * BLOCKSIZE + 700);
+  memcpy(copy + 2 * BLOCKSIZE + 10, record, 50);
+  memcpy(copy + 6 * BLOCKSIZE, record, BLOCKSIZE);
+  memcpy(copy, record, 100);
+  memcpy(copy + 4 * BLOCKSIZE, record, 100);
+  check_contents("base", data, 6 * BLOCKSIZE + 700);
+  check_contents("copy", copy, 7 * BLOCKSIZE);
+  vsumount();
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  check_contents("base", data, 6 * BLOCKSIZE + 700);
+  check_contents("copy", copy, 7 * BLOCKSIZE);
+  vsumount();
+}
+
+Test(vsfs, vstruncate_frees_blocks, .disabled = false)
+{
+  static char data[40 * BLOCKSIZE];
+  cr_assert(eq(int, vsformat(vdiskname, 18), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+
+  // the disk only survives the rounds if truncated blocks are given back
+  int size = 40 * BLOCKSIZE;
+  clone_object(data, 1, size);
+  cr_assert(eq(int, vscreate("file"), 0));
+  int fd = vsopen("file", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 3 * BLOCKSIZE + 100), 0));
+  for (int round = 0; round < 20; round++)
+  {
+    cr_assert(eq(int, vsappend(fd, data + 3 * BLOCKSIZE + 100, size - 3 * BLOCKSIZE - 100), 0));
+    cr_assert(eq(int, vstruncate(fd, 3 * BLOCKSIZE + 100), 0));
+  }
+  cr_assert(eq(int, vstruncate(fd, size), -1));
+  cr_assert(eq(int, vsclose(fd), 0));
+  check_contents("file", data, 3 * BLOCKSIZE + 100);
+
+  // a packed tail, a clone and the inline case
+  fd = vsopen("file", MODE_WRITE);
+  cr_assert(eq(int, vstruncate(fd, 2 * BLOCKSIZE + 50), 0));
+  cr_assert(eq(int, vspwrite(fd, data + 2 * BLOCKSIZE + 50, 100, 2 * BLOCKSIZE + 50), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  check_contents("file", data, 2 * BLOCKSIZE + 150);
+  cr_assert(eq(int, vsclone("file", "copy"), 0));
+  fd = vsopen("copy", MODE_WRITE);
+  cr_assert(eq(int, vstruncate(fd, BLOCKSIZE + 10), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  fd = vsopen("file", MODE_WRITE);
+  cr_assert(eq(int, vstruncate(fd, 2 * BLOCKSIZE + 100), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  vsumount();
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  check_contents("file", data, 2 * BLOCKSIZE + 100);
+  check_contents("copy", data, BLOCKSIZE + 10);
+  fd = vsopen("copy", MODE_WRITE);
+  cr_assert(eq(int, vstruncate(fd, 0), 0));
+  cr_assert(eq(int, vspwrite(fd, data, 40, 0), 0));
+  cr_assert(eq(int, vstruncate(fd, 20), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  check_contents("copy", data, 20);
+  cr_assert(eq(int, vsdelete("file"), 0));
+  cr_assert(eq(int, vsdelete("copy"), 0));
+  vsumount();
+}
+
+Test(vsfs, vsdelete_open_file, .disabled = false)
+{
+  char data[3000];
+  memset(data, 'a', sizeof(data));
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("a"), 0));
+  int fd = vsopen("a", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 100), 0));
+  cr_assert(eq(int, vsdelete("a"), -1));
+  cr_assert(eq(int, vsclose(fd), 0));
+  cr_assert(eq(int, vsdelete("a"), 0));
+
+  cr_assert(eq(int, vscreate("b"), 0));
+  fd = vsopen("b", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, 3000), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  check_contents("b", data, 3000);
+  vsumount();
+}
+
+Test(vsfs, vsdelete_then_grow_directory, .disabled = false)
+{
+  char data[1500];
+  char filename[32];
+  memset(data, 'd', sizeof(data));
+  cr_assert(eq(int, vsformat(vdiskname, 20), 0));
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  cr_assert(eq(int, vscreate("a"), 0));
+  int fd = vsopen("a", MODE_APPEND);
+  cr_assert(eq(int, vsappend(fd, data, sizeof(data)), 0));
+  cr_assert(eq(int, vsclose(fd), 0));
+  cr_assert(eq(int, vsdelete("a"), 0));
+
+  // the freed block comes back as a directory extension block, the
+  // zeroes of the delete must not land on it
+  for (int file = 0; file < 140; file++)
+  {
+    snprintf(filename, sizeof(filename), "file%d", file);
+    cr_assert(eq(int, vscreate(filename), 0));
+  }
+  vsumount();
+  cr_assert(eq(int, vsmount(vdiskname), 0));
+  for (int file = 0; file < 140; file++)
+  {
+    snprintf(filename, sizeof(filename), "file%d", file);
+    fd = vsopen(filename, MODE_READ);
+    cr_assert(ge(int, fd, 0));
+    vsclose(fd);
+  }
+  vsumount();
+}